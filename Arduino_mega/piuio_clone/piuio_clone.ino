@@ -18,6 +18,8 @@
 /***********************************************************/
 //#include "usbconfig.h"
 #include <usbdrv.h>
+#include <piuio_lamps.h>
+#include <piuio_marks.h>
 
 //use PORT E for usb connection(MODIFY usbconfig.h)
 //use PORT F for cabinet and pad P1((Cabinet=(left=PF0,center=PF1,right,=PF2),Pad=(DOWN=PF3,LEFT=PF4,UP=PF6,RIGHT=PF7))
@@ -25,34 +27,320 @@
 //use PORT G for Coin->PG2,Service->PG1,Menu->PG0
 //use PORT L for Pads lights
 //use PORT C for Cabinet lights
+//use PORT A for the pad sensor muxers with AUTO_MUX (P1=PA0-1, P2=PA2-3)
 
 #define GETBIT(port,_bit) ((port) & (0x01 << (_bit)))     //    Get Byte bit
 #define SETBIT(port,_bit) ((port) |= (0x01 << (_bit)))    //    Set Byte bit
 #define CLRBIT(port,_bit) ((port) &= ~(0x01 << (_bit)))   //    Clr Byte bit
+//    How the OpenITG lamp bits map to PORTL and PORTC, see piuio_lamps.h.
+//    No latches here: a lamp frame goes out with one store per port.
+#define LAMP_PROFILE MegaLamps
+
+//    Uncomment to put 2 bit muxers (4052 or alike) in front of PINF and PINK,
+//    selected from MUX_PORT, so each panel gets its four sensors. Every
+//    pollInputOutput() reads all four muxer positions of both players into
+//    InputCache with a port read each, and the game gets the sensor it asks
+//    with ZZ right away instead of us switching the muxers after its lamp
+//    write. Pins of PINF/PINK not behind a muxer read the same on all four.
+//#define AUTO_MUX
+//    With AUTO_MUX, answer with every sensor of each panel merged (a panel
+//    is down when any of its sensors is) instead of the one selected by ZZ.
+//#define AUTO_MUX_MERGE
+#define MUX_PORT PORTA
+#define MUX_DDR DDRA
+#define MUX_SETTLE_US 10                //    Wait after switching the muxers before the next read, for the sensor lines to follow
+
+//    Uncomment to log every input edge with a Timer1 timestamp (4us ticks at
+//    16MHz). The game only sees the state at the moment it reads, so a tap
+//    shorter than its polling is lost; the log keeps it. Read it back with
+//    a 0xC0 request with bRequest EDGE_REQUEST, see docs/piuio.txt
+//    With AUTO_MUX the muxer position is in bits 5-6 of the input number.
+//#define EDGE_LOG
+#define EDGE_REQUEST 0xAF
+#define EDGE_LOG_SIZE 32                //    Must be a power of two
+
+//    Uncomment to debounce the inputs. Every input has its own 3 bit counter,
+//    but the counters are kept as bit planes (vertical counters), so the 8
+//    inputs of a byte are all handled with a few AND/XOR per scan.
+//    The report is active low: an input has to read 0 (down) for
+//    DEBOUNCE_PRESS scans in a row to be pressed in the report and 1 for
+//    DEBOUNCE_RELEASE scans in a row to be released again, so a press gets
+//    through fast and a sensor flickering while held doesn't drop it.
+//    Both go from 1 (no debounce) to 7.
+//#define DEBOUNCE
+#define DEBOUNCE_PRESS 2
+#define DEBOUNCE_RELEASE 4
+
+//    Uncomment to fill the report bytes OpenITG ignores (4-7, 0xFF junk on
+//    the original board) with where the report comes from, see
+//    docs/piuio.txt: the number of its scan, how many lamp frames had come
+//    in by then and how old the scan is when the PC asks. The PC can then
+//    tell a repeated report from a new one and how stale it is.
+//#define REPORT_META
+
+//    Uncomment to scan the inputs at a fixed SCAN_RATE (in Hz) instead of on
+//    every loop. Timer2 ticks at that rate and loop() scans once per tick.
+//    The tick interrupt turns interrupts back on as its first instruction,
+//    so it never holds up V-USB; the scan itself stays in loop().
+//    Achieved rate, time between scans and overruns are in the statistics.
+//#define SCAN_TIMER
+#define SCAN_RATE 2000
+
+//    Uncomment to write a marker to GPIOR0 when loop(), usbPoll(), the input
+//    scan and a lamp update start and end, so an AVR simulator can
+//    count AVR cycles between them. Each marker is one OUT instruction, the
+//    IDs are in piuio_marks.h
+//#define BENCH_MARKS
+#ifdef BENCH_MARKS
+#define MARK(id) (GPIOR0 = (id))
+#else
+#define MARK(id)
+#endif
+
+//    bRequest of the clone statistics read (0xC0), see docs/piuio.txt
+#define STATS_REQUEST 0xB0
+//    bRequest of the combined lamp write and input read (0xC0). The lamp
+//    bytes come in wValue/wIndex and the reply is the 0xAE input report,
+//    so one transfer does what a 0x40 write and a 0xC0 read do.
+#define COMBINED_REQUEST 0xB1
 
 //    Some Vars to help
-static unsigned char LampData[8];       //    The LampData buffer received
-static unsigned char InputData[8];      //    The InputData buffer to send
+static unsigned char InputReports[2][8];        //    Two input reports, so a scan never writes the one being sent
+static unsigned char *InputData = InputReports[0];  //    The InputData buffer to send, always one whole scan
+static unsigned char *InputNext = InputReports[1];  //    The one pollInputOutput() fills
 static unsigned char datareceived = 0;  //    How many bytes we received
 static unsigned char dataLength = 0;    //    Total to receive
 
 static unsigned char Input[2];          //    The actual 16 bits Input data
-static unsigned char Output[2];         //    The actual 16 bits Output data
+#ifdef AUTO_MUX
+static unsigned char InputCache[4][2];  //    The 16 bits Input data for each muxer position
+#endif
+#if USB_CFG_HAVE_INTRIN_ENDPOINT
+static unsigned char ReportData[8];     //    The last InputData pushed on the interrupt endpoint
+static unsigned char ReportPending = 1; //    InputData changed since then
+#endif
+static unsigned char OutputFrames[2][4];            //    Two lamp frames, the game writes straight into the back one
+static unsigned char *Output = OutputFrames[0];     //    The actual 32 bits Output data, always one whole frame
+static unsigned char *OutputNext = OutputFrames[1]; //    The frame usbFunctionWrite() fills
+static unsigned char LampFrames = 0;    //    Lamp frames received, wrapping
+static unsigned int LatchesDone = 0;    //    Lamp frames that changed the lamp ports
+static unsigned int LatchesSkipped = 0; //    Lamp frames that had the same lamps as the ports already had
+static unsigned int Scans = 0;          //    Scans done, wrapping
+static unsigned int ScanOverruns = 0;   //    Timer2 ticks we were too busy to scan for
+static unsigned int ScanLast = 0;       //    Timer1 at the last scan
+static unsigned int ScanMin = 0xFFFF;   //    Shortest and longest time between two scans in Timer1
+static unsigned int ScanMax = 0;        //    ticks since the statistics were last read
+static unsigned int PollLast = 0;       //    Timer1 when usbPoll() last returned
+static unsigned int PollGapMax = 0;     //    Longest time without usbPoll() in Timer1 ticks since the statistics were last read
+static unsigned char StatsReport[14];   //    What we send to the PC on STATS_REQUEST
+#ifdef SCAN_TIMER
+static volatile unsigned char ScanTicks = 0;    //    Timer2 ticks, counted by the interrupt
+static unsigned char ScanDone = 0;      //    Ticks already scanned for
+#endif
+
+#ifdef DEBOUNCE
+struct debouncer    {                   //    8 inputs worth of vertical counters
+    unsigned char state;                //    The debounced bits
+    unsigned char c0, c1, c2;           //    Bit 0, 1 and 2 of each counter
+};
+#ifdef AUTO_MUX
+static struct debouncer Debounce[4][2]; //    P1 and P2, each muxer position has its own sensors
+#else
+static struct debouncer Debounce[1][2]; //    P1 and P2
+#endif
+static struct debouncer DebounceButtons;    //    The operator buttons
+#endif
+
+#ifdef EDGE_LOG
+static unsigned char EdgeLog[EDGE_LOG_SIZE][3]; //    Input number | level << 7, timestamp low, timestamp high
+static unsigned char EdgeHead = 0;      //    Next slot to write
+static unsigned char EdgeTail = 0;      //    Next slot to read
+static unsigned char EdgeLost = 0;      //    Edges dropped because the log was full
+static unsigned char EdgeReport[4 + EDGE_LOG_SIZE * 3];  //    What we send to the PC
+
+void logEdges(unsigned char first, unsigned char before, unsigned char now)    {
+    //    Logs every bit that changed between two scans of 8 inputs.
+    //    first is the input number of bit 0 (report byte * 8 + bit).
+    unsigned char changed = before ^ now;
+    unsigned int stamp = TCNT1;
+    for(unsigned char n = first; changed; n++, changed >>= 1, now >>= 1)    {
+        if(!(changed & 1))
+            continue;
+        if(((EdgeHead + 1) & (EDGE_LOG_SIZE - 1)) == EdgeTail)    {    //    Full, the PC is not reading
+            if(EdgeLost < 255)
+                EdgeLost++;
+            continue;
+        }
+        EdgeLog[EdgeHead][0] = n | ((now & 1) << 7);
+        EdgeLog[EdgeHead][1] = stamp & 0xFF;
+        EdgeLog[EdgeHead][2] = stamp >> 8;
+        EdgeHead = (EdgeHead + 1) & (EDGE_LOG_SIZE - 1);
+    }
+}
+
+unsigned char readEdges(unsigned char maxlen)    {
+    //    Moves as many edges as fit in maxlen bytes to EdgeReport.
+    //    Returns how many bytes to send.
+    unsigned int stamp = TCNT1;
+    unsigned char count = 0;
+    unsigned char *p = EdgeReport + 4;
+    if(maxlen < 4)
+        return 0;                                                   //    Not even the header fits, keep everything
+    while(EdgeTail != EdgeHead && maxlen - 4 - count * 3 >= 3)    {
+        *p++ = EdgeLog[EdgeTail][0];
+        *p++ = EdgeLog[EdgeTail][1];
+        *p++ = EdgeLog[EdgeTail][2];
+        EdgeTail = (EdgeTail + 1) & (EDGE_LOG_SIZE - 1);
+        count++;
+    }
+    EdgeReport[0] = count;
+    EdgeReport[1] = EdgeLost;
+    EdgeReport[2] = stamp & 0xFF;                                  //    Timer1 now, so the PC can place the edges in time
+    EdgeReport[3] = stamp >> 8;
+    EdgeLost = 0;
+    return 4 + count * 3;
+}
+#endif
+
+#ifdef DEBOUNCE
+#if DEBOUNCE_PRESS < 1 || DEBOUNCE_PRESS > 7 || DEBOUNCE_RELEASE < 1 || DEBOUNCE_RELEASE > 7
+#error DEBOUNCE_PRESS and DEBOUNCE_RELEASE must be from 1 to 7
+#endif
+//    Lanes of a vertical counter that hold the constant k
+#define COUNTER_IS(d,k) ((((k) & 1) ? (d)->c0 : ~(d)->c0) & (((k) & 2) ? (d)->c1 : ~(d)->c1) & (((k) & 4) ? (d)->c2 : ~(d)->c2))
+
+unsigned char debounce(struct debouncer *d, unsigned char raw)    {
+    //    Counts, for each bit, how many scans in a row raw disagreed with the
+    //    debounced state, and flips the state when it reaches the threshold.
+    unsigned char delta = raw ^ d->state;
+    unsigned char carry = delta;
+    unsigned char done;
+    d->c0 &= delta;                                                 //    Restart the bits that agree again
+    d->c1 &= delta;
+    d->c2 &= delta;
+    d->c0 ^= carry;    carry &= ~d->c0;                             //    Increment the ones that do not
+    d->c1 ^= carry;    carry &= ~d->c1;
+    d->c2 ^= carry;
+    done = (COUNTER_IS(d, DEBOUNCE_RELEASE) & ~d->state) | (COUNTER_IS(d, DEBOUNCE_PRESS) & d->state);    //    Down is 0
+    done &= delta;
+    d->state ^= done;
+    d->c0 &= ~done;
+    d->c1 &= ~done;
+    d->c2 &= ~done;
+    return d->state;
+}
+#endif
+
+void timeScan()    {
+    //    Keeps the scan statistics, called at the start of every scan
+    unsigned int now = TCNT1;
+    unsigned int interval = now - ScanLast;
+    ScanLast = now;
+    if(Scans)    {                                                   //    The first one has nothing to compare with
+        if(interval < ScanMin)
+            ScanMin = interval;
+        if(interval > ScanMax)
+            ScanMax = interval;
+    }
+    Scans++;
+}
+
+#ifdef SCAN_TIMER
+#if F_CPU / 32 / SCAN_RATE > 256 || F_CPU / 32 / SCAN_RATE < 16
+#error SCAN_RATE out of the Timer2 range
+#endif
+ISR(TIMER2_COMPA_vect, ISR_NOBLOCK)    {
+    ScanTicks++;
+}
+
+unsigned char scanDue()    {
+    //    1 if Timer2 ticked since the last scan. Extra ticks are overruns.
+    unsigned char ticks = ScanTicks;
+    if(ticks == ScanDone)
+        return 0;
+    ScanOverruns += (unsigned char)(ticks - ScanDone - 1);
+    ScanDone = ticks;
+    return 1;
+}
+#endif
+
+unsigned char readStats()    {
+    //    Fills StatsReport, returns how many bytes to send
+    StatsReport[0] = LatchesDone & 0xFF;                            //    The ports are our latches
+    StatsReport[1] = LatchesDone >> 8;
+    StatsReport[2] = LatchesSkipped & 0xFF;
+    StatsReport[3] = LatchesSkipped >> 8;
+    StatsReport[4] = Scans & 0xFF;
+    StatsReport[5] = Scans >> 8;
+    StatsReport[6] = ScanOverruns & 0xFF;
+    StatsReport[7] = ScanOverruns >> 8;
+    StatsReport[8] = ScanMin & 0xFF;
+    StatsReport[9] = ScanMin >> 8;
+    StatsReport[10] = ScanMax & 0xFF;
+    StatsReport[11] = ScanMax >> 8;
+    StatsReport[12] = PollGapMax & 0xFF;
+    StatsReport[13] = PollGapMax >> 8;
+    ScanMin = 0xFFFF;                                               //    A new window starts with each read
+    ScanMax = 0;
+    PollGapMax = 0;
+    return 14;
+}
+
+void updateLamps()    {
+    //    Puts the lamps of Output on the ports. Both are plain stores, so the
+    //    lamps change within a few cycles of the frame being complete.
+    unsigned char halo = LAMP_PROFILE::Halo::get(Output);
+    //first 4 bits are for player 1 , other 4 bits for player 2
+    unsigned char pads_lights = LAMP_PROFILE::Pads::get(Output);
+    if(halo == PORTC && pads_lights == PORTL)    {                 //    Same lamps, the ports already show them
+        LatchesSkipped++;
+        return;
+    }
+    PORTL = pads_lights;
+    PORTC = halo;
+    LatchesDone++;
+}
+
+void commitLamps(unsigned char filled)    {
+    //    Makes OutputNext the frame everything reads, with a pointer swap, so
+    //    no one ever sees half a frame. Bytes a short write did not reach keep
+    //    their last value.
+    unsigned char *frame = OutputNext;
+    for(; filled < 4; filled++)
+        frame[filled] = Output[filled];
+    OutputNext = Output;
+    Output = frame;
+    LampFrames++;
+    MARK(MARK_LAMPS);
+    updateLamps();
+    MARK(MARK_LAMPS | MARK_EXIT);
+}
 
 USB_PUBLIC uchar usbFunctionWrite(uchar *data, uchar len) {
     //    This function will be only triggered when game writes to the lamps output.
     unsigned char i;              
-    for(i = 0; datareceived < 8 && i < len; i++, datareceived++)
-               LampData[datareceived] = data[i];    
+    for(i = 0; i < len; i++, datareceived++)
+        if(datareceived < 4)
+            OutputNext[datareceived] = data[i];   //    The other bytes are just 0xFF junk
     if(datareceived == dataLength)    {    //    Time to set OUTPUT
-        Output[0] = LampData[0];           //    The AM use unsigned short for those. 
-        Output[1] = LampData[2];           //    So we just skip one byte
-                                           //    The other bytes are just 0xFF junk
+        commitLamps(datareceived);
     }    
     return (datareceived == dataLength);   // 1 if we received it all, 0 if not
 }
 
-USB_PUBLIC uchar usbFunctionSetup(uchar data[8]) {
+void pollInputOutput();                 //    Below, the combined request scans too
+
+#ifdef REPORT_META
+void stampReport()    {
+    //    Puts how old the scan of InputData is now in its BYTE7, in 64us steps
+    unsigned int age = (TCNT1 - ScanLast) >> 4;
+    InputData[7] = age > 255 ? 255 : age;
+}
+#else
+#define stampReport()
+#endif
+
+USB_PUBLIC usbMsgLen_t usbFunctionSetup(uchar data[8]) {
     usbRequest_t *rq = (usbRequest_t *)data;
     if(rq->bRequest == 0xAE)    {                               //    Access Game IO
         switch(rq->bmRequestType)    {
@@ -62,38 +350,131 @@ USB_PUBLIC uchar usbFunctionSetup(uchar data[8]) {
                 return USB_NO_MSG;                              //    Just tell we want a callback to usbFunctionWrite
             break;
             case 0xC0:                                          //    Reading input data
+                stampReport();
                 usbMsgPtr = InputData;                          //    Just point to the buffer, and 
                 return 8;                                       //    saying to send 8 bytes to the PC
             break;
         }
     }
+    if(rq->bRequest == COMBINED_REQUEST && rq->bmRequestType == 0xC0)    {  //    Lamps in, inputs out
+        OutputNext[0] = rq->wValue.bytes[0];                    //    Same bytes as the 0x40 write keeps
+        OutputNext[1] = rq->wValue.bytes[1];
+        OutputNext[2] = rq->wIndex.bytes[0];
+        OutputNext[3] = rq->wIndex.bytes[1];
+        commitLamps(4);
+        pollInputOutput();
+        stampReport();
+        usbMsgPtr = InputData;
+        return 8;
+    }
+    if(rq->bRequest == STATS_REQUEST && rq->bmRequestType == 0xC0)    { //    Clone statistics
+        usbMsgPtr = StatsReport;
+        return readStats();
+    }
+#ifdef EDGE_LOG
+    if(rq->bRequest == EDGE_REQUEST && rq->bmRequestType == 0xC0)    {  //    Drain the edge log
+        usbMsgPtr = EdgeReport;
+        return readEdges(rq->wLength.bytes[1] ? 255 : rq->wLength.bytes[0]);
+    }
+#endif
     return 0;                                                   //    Ops, it cant get here
 }
 
+void publishInput()    {
+    //    Makes the report pollInputOutput() just filled the one the PC gets.
+    //    Only the pointer changes hands, so a request never sees half a scan.
+    //    The old report becomes the next one to fill; V-USB copies usbMsgPtr
+    //    out within the same usbPoll(), long before that.
+    unsigned char *filled = InputNext;
+    InputNext = InputData;
+    InputData = filled;
+}
+
 void pollInputOutput()    {
-    //on Arduino Mega we don't use muxer nor output latch
-
-      //HERE WE FILTER THE BITS FROM THE GAME, openITG
-    unsigned char neon_bit = Output[1] & 0b00000100;
-    unsigned char cabinet_buttons = Output[1] & 0b00011000;
-    unsigned char halo = (Output[3] & 0b00000111) | ((Output[2] & 0b10000000)>> 4 );
-    halo |= neon_bit << 2;
-    halo |= cabinet_buttons << 2;
-  
-    //first 4 bits are for player 1 , other 4 bits for player 2
-    unsigned char pads_lights = Output[0] & 0b00111100;
-    pads_lights = pads_lights << 2;
-    pads_lights |= (Output[2] & 0b00111100) >> 2; 
-                                                                      //    Okay, so now we can set the output buffer, just in case the PC asks now the inputs
-    Input[0] = PINF;
-    Input[1] = PINK;
-    InputData[0] = ~Input[0];
-    InputData[1] = ~PING;                                                   //    Andamiro uses unsigned short here also
-    InputData[2] = ~Input[1];
-    InputData[3] = ~PING;     
+    //on Arduino Mega we don't use an output latch, the lamps go out in updateLamps()
+    MARK(MARK_SCAN);
+    timeScan();
+
+    unsigned char buttons = ~PING;                                      //    The report has the pin levels inverted
+#ifdef DEBOUNCE
+    buttons = debounce(&DebounceButtons, buttons);
+#endif
+#ifdef EDGE_LOG
+    logEdges(8, InputData[1], buttons);
+    logEdges(24, InputData[3], buttons);
+#endif
+#ifdef AUTO_MUX
+    unsigned char pos;
+    for(pos = 0; pos < 4; pos++)    {                                   //    The muxers were left on 0 by the last call
+        Input[0] = ~PINF;
+        Input[1] = ~PINK;
+        MUX_PORT = ((pos + 1) & 3) * 0b0101;                            //    Both players, the next one starts settling
+#ifdef DEBOUNCE
+        Input[0] = debounce(&Debounce[pos][0], Input[0]);
+        Input[1] = debounce(&Debounce[pos][1], Input[1]);
+#endif
+#ifdef EDGE_LOG
+        logEdges(pos << 5, InputCache[pos][0], Input[0]);
+        logEdges((pos << 5) | 16, InputCache[pos][1], Input[1]);
+#endif
+        InputCache[pos][0] = Input[0];
+        InputCache[pos][1] = Input[1];
+        if(pos < 3)                                                     //    Position 0 has until the next call
+            delayMicroseconds(MUX_SETTLE_US);                           //    The stores above are only a few cycles
+    }
+#ifdef AUTO_MUX_MERGE
+    InputNext[0] = InputCache[0][0] & InputCache[1][0] & InputCache[2][0] & InputCache[3][0];   //    Down is 0 in the report
+    InputNext[2] = InputCache[0][1] & InputCache[1][1] & InputCache[2][1] & InputCache[3][1];
+#else
+    InputNext[0] = InputCache[Output[0] & 3][0];                        //    ZZ of P1
+    InputNext[2] = InputCache[Output[2] & 3][1];                        //    ZZ of P2
+#endif
+#else
+    Input[0] = ~PINF;
+    Input[1] = ~PINK;
+#ifdef DEBOUNCE
+    Input[0] = debounce(&Debounce[0][0], Input[0]);
+    Input[1] = debounce(&Debounce[0][1], Input[1]);
+#endif
+#ifdef EDGE_LOG
+    logEdges(0, InputData[0], Input[0]);
+    logEdges(16, InputData[2], Input[1]);
+#endif
+    InputNext[0] = Input[0];
+    InputNext[2] = Input[1];
+#endif
+    InputNext[1] = buttons;                                             //    Andamiro uses unsigned short here also
+    InputNext[3] = buttons;
+#ifdef REPORT_META
+    InputNext[4] = (Scans - 1) & 0xFF;                                  //    timeScan() counted this one already
+    InputNext[5] = (Scans - 1) >> 8;
+    InputNext[6] = LampFrames;
+#endif
+    publishInput();
+    MARK(MARK_SCAN | MARK_EXIT);
 }
 
 
+#if USB_CFG_HAVE_INTRIN_ENDPOINT
+void sendInputChanges()    {
+    //    Pushes InputData on the interrupt-in endpoint, but only when it changed.
+    //    If the last report was not fetched by the host yet, we keep it pending
+    //    and send the newest state as soon as the endpoint is free.
+    //    Only the inputs count as a change, REPORT_META moves with every scan.
+    unsigned char i;
+    for(i = 0; i < 4; i++)
+        if(ReportData[i] != InputData[i])
+            ReportPending = 1;
+    if(ReportPending && usbInterruptIsReady())    {
+        stampReport();
+        for(i = 0; i < 8; i++)
+            ReportData[i] = InputData[i];
+        usbSetInterrupt(ReportData, 8);
+        ReportPending = 0;
+    }
+}
+#endif
+
 void setup() {
       unsigned char i;
     //Set port as input
@@ -105,19 +486,55 @@ void setup() {
     DDRL = 255;
     PORTC = 0;
     PORTL = 0;
-    for(i=0;i<8;i++)
-        InputData[i] = 0xFF;
+#ifdef AUTO_MUX
+    MUX_DDR = 0b00001111;                       // pad muxers, starting on position 0
+    MUX_PORT = 0;
+#endif
+    for(i=0;i<8;i++)    {
+        InputReports[0][i] = 0xFF;
+        InputReports[1][i] = 0xFF;
+    }
     usbInit();
     usbDeviceDisconnect();                      // enforce re-enumeration
     for(i = 0; i<250; i++) {                    // wait 500 ms
         delayMicroseconds(100);
     }
     usbDeviceConnect();
+    TCCR1A = 0;                                 // Timer1 free running at F_CPU/64 for timestamps
+    TCCR1B = (1 << CS11) | (1 << CS10);
+#ifdef SCAN_TIMER
+    TCCR2A = (1 << WGM21);                      // Timer2 ticks at SCAN_RATE to pace the input scan
+    TCCR2B = (1 << CS21) | (1 << CS20);         // F_CPU/32
+    OCR2A = F_CPU / 32 / SCAN_RATE - 1;
+    TIMSK2 = (1 << OCIE2A);
+#endif
     sei();
 
 }
 
+void pollUsb()    {
+    //    usbPoll(), keeping the longest time since it last returned
+    unsigned int gap = TCNT1 - PollLast;
+    if(gap > PollGapMax)
+        PollGapMax = gap;
+    MARK(MARK_USBPOLL);
+    usbPoll();
+    MARK(MARK_USBPOLL | MARK_EXIT);
+    PollLast = TCNT1;
+}
+
 void loop() {
-        usbPoll();
+        MARK(MARK_LOOP);
+        pollUsb();
+#ifdef SCAN_TIMER
+        if(!scanDue())    {
+                MARK(MARK_LOOP | MARK_EXIT);
+                return;
+        }
+#endif
         pollInputOutput();
+#if USB_CFG_HAVE_INTRIN_ENDPOINT
+        sendInputChanges();
+#endif
+        MARK(MARK_LOOP | MARK_EXIT);
 }
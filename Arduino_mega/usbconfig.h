@@ -23,7 +23,8 @@
 #define USB_CFG_IOPORTNAME      D               //  We use PORT D to USB Port Pins
 #define USB_CFG_DMINUS_BIT      0               //  This is the USB D- line. PORTD.0
 #define USB_CFG_DPLUS_BIT       1               //  This is the USB D+ line. PORTD.1
-                                                //  The D+ from USB must be also connected to INT0, on ATMEGA328 is the PORTD.2
+                                                //  V-USB takes its interrupt on INT0, which is PORTD.0 on the ATmega2560, so here it comes from D-.
+                                                //  V-USB allows that, the interrupt then also fires on every 1ms Start-Of-Frame
 #define USB_CFG_CLOCK_KHZ       (F_CPU/1000)    //  This is the USB clock in kHz. we just use AVR Frequency / 1000;
                                                 //  The good values for crystal: 12MHz, 12.8Mhz, 15MHz, 16Mhz, 16.5Mhz, 18Mhz, 20Mhz
                                                 //  The F_CPU is the definition of the clock, so you dont need to change anything here
@@ -34,12 +35,13 @@
 // There is too many stuff here lol, so I will just comment a few of these and also if its not default value, I will say why I changed.
 // You can look what each one does at the original usbconfig from V-USB
 
-#define USB_CFG_HAVE_INTRIN_ENDPOINT    0       //  We dont need any additional entry points, so this will be 0
+#define USB_CFG_HAVE_INTRIN_ENDPOINT    0       //  Set to 1 to also push input changes on the interrupt-in endpoint 1 (see sendInputChanges() in the sketch).
+                                                //  OpenITG only uses the 0xAE control requests, and those keep working either way
 #define USB_CFG_HAVE_INTRIN_ENDPOINT3   0       //  Same as below
 #define USB_CFG_EP3_NUMBER              3       //  The Entrypoint 3 number. We dont need it, so we keep default.
 #define USB_CFG_IMPLEMENT_HALT          0       //  Thats for interrupting a endpoint. We dont need it
 #define USB_CFG_SUPPRESS_INTR_CODE      0       
-#define USB_CFG_INTR_POLL_INTERVAL      10
+#define USB_CFG_INTR_POLL_INTERVAL      10      //  Interrupt-in poll interval in ms. 10 is the lowest a low speed device can ask for
 #define USB_CFG_IS_SELF_POWERED         0       //  PIUIO does have own power supply. But I dont like that lol, so mine is just USB powered.
 #define USB_CFG_MAX_BUS_POWER           500     //  This is the value in mA, it will be divided by two (100 mean 50mA). Its just an info for PC
 #define USB_CFG_IMPLEMENT_FN_WRITE      1       //  We implemented a write-from-computer function. This is basicly used when game writes the lamp data.
@@ -19,6 +19,9 @@
 //#include "usbconfig.h"
 #include <usbdrv.h>
 #include <SPI.h> //for faster shift register
+#include <avr/eeprom.h>
+#include <piuio_lamps.h>
+#include <piuio_marks.h>
 //    Some Macros to help
 
 #define GETBIT(port,_bit) ((port) & (0x01 << (_bit)))     //    Get Byte bit
@@ -26,34 +29,675 @@
 #define CLRBIT(port,_bit) ((port) &= ~(0x01 << (_bit)))   //    Clr Byte bit
 //PORTB pins for shift register
 #define LATCH 2
+//    How the OpenITG lamp bits map to our latches, see piuio_lamps.h
+#define LAMP_PROFILE CloneLamps
+
+//    74HC595s in the lamp chain. The bytes are shifted by writing SPDR and
+//    feeding the next one once the SPI is done, from serviceLamps(), so the
+//    loop never waits on the SPI. An SPI interrupt could do the feeding too,
+//    but any other interrupt delays the V-USB one, so we poll instead.
+#define LAMP_CHAIN 2
+#if LAMP_CHAIN < 2
+#error The halo and pad lamps need at least two 74HC595
+#endif
+
+//    Uncomment to read the inputs from 74HC165s on the SPI bus instead of
+//    stepping the 4067. Their chain goes on MISO with the clock of the lamp
+//    chain and SH/LD on PORTB1. Every scan loads them and clocks their bytes
+//    in while lamp bytes go out, so 16 inputs take two SPI bytes instead of
+//    16 muxer steps, and more inputs only add bytes to the same exchange.
+//    The SPI runs LSB first: the 74HC165 next to MISO is report BYTE0 and its
+//    H input is bit 0, the next one is BYTE2. A third and a fourth one are
+//    the buttons of BYTE1 and BYTE3, which the 4067 never had.
+//#define SHIFT_INPUTS
+#define INPUT_CHAIN 2
+#define INPUT_LOAD 1
+#ifdef SHIFT_INPUTS
+#if INPUT_CHAIN < 2 || INPUT_CHAIN > 4
+#error INPUT_CHAIN goes from 2 (the pads) to 4 (the pads and the buttons of both players)
+#endif
+#define SHIFT_BYTES (LAMP_CHAIN > INPUT_CHAIN ? LAMP_CHAIN : INPUT_CHAIN)
+#endif
+
+//    bRequest of the clone statistics read (0xC0), see docs/piuio.txt
+#define STATS_REQUEST 0xB0
+//    bRequest of the combined lamp write and input read (0xC0). The lamp
+//    bytes come in wValue/wIndex and the reply is the 0xAE input report,
+//    so one transfer does what a 0x40 write and a 0xC0 read do.
+#define COMBINED_REQUEST 0xB1
+
+//    Uncomment to let the board step the pad sensor muxers by itself.
+//    The 2 bit muxer selector goes on PORTC4-5 (PORTC0-3 is the 4067), and
+//    every pollInputOutput() scans one muxer position into InputCache, so the
+//    game gets the sensor it asks with ZZ right away instead of waiting for us
+//    to switch the muxers after its lamp write.
+//#define AUTO_MUX
+//    With AUTO_MUX, answer with every sensor of each panel merged (a panel
+//    is down when any of its sensors is) instead of the one selected by ZZ.
+//#define AUTO_MUX_MERGE
+#define MUX_SHIFT 4
+
+//    Uncomment to give each 4067 channel the settle time it needs and no
+//    more. The scan goes over the channels in Gray code order, so only one
+//    select line moves per step, and waits Settle[channel] steps of about 4
+//    cycles after switching before it reads. The table comes from EEPROM
+//    and is measured on the cabinet with a 0xC0 request with bRequest
+//    SETTLE_REQUEST, see docs/piuio.txt: for each channel, how long after
+//    coming from a channel at the other level it reads stable, plus
+//    SETTLE_MARGIN. A switch between two channels at the same level shows
+//    nothing, so step on the panels while it runs.
+//#define MUX_SETTLE
+#define SETTLE_REQUEST 0xB3
+#define SETTLE_MAX 64                   //    Longest settle measured, in steps
+#define SETTLE_MARGIN 2                 //    Added to what was measured
+#define SETTLE_EEPROM 0                 //    Where the table goes in EEPROM, 17 bytes
+#define SETTLE_MAGIC 0xA5
+#define CALIBRATE_TRIALS 8              //    Waits tried per loop
+#if defined(MUX_SETTLE) && defined(SHIFT_INPUTS)
+#error MUX_SETTLE is for the 4067, SHIFT_INPUTS has none
+#endif
+
+//    Uncomment to log every input edge with a Timer1 timestamp (4us ticks at
+//    16MHz). The game only sees the state at the moment it reads, so a tap
+//    shorter than its polling is lost; the log keeps it. Read it back with
+//    a 0xC0 request with bRequest EDGE_REQUEST, see docs/piuio.txt
+//    With AUTO_MUX the muxer position is in bits 5-6 of the input number.
+//#define EDGE_LOG
+#define EDGE_REQUEST 0xAF
+#define EDGE_LOG_SIZE 32                //    Must be a power of two
+
+//    Uncomment to debounce the inputs. Every input has its own 3 bit counter,
+//    but the counters are kept as bit planes (vertical counters), so the 8
+//    inputs of a byte are all handled with a few AND/XOR per scan.
+//    The report is active low: an input has to read 0 (down) for
+//    DEBOUNCE_PRESS scans in a row to be pressed in the report and 1 for
+//    DEBOUNCE_RELEASE scans in a row to be released again, so a press gets
+//    through fast and a sensor flickering while held doesn't drop it.
+//    Both go from 1 (no debounce) to 7.
+//#define DEBOUNCE
+#define DEBOUNCE_PRESS 2
+#define DEBOUNCE_RELEASE 4
+
+//    Uncomment to fill the report bytes OpenITG ignores (4-7, 0xFF junk on
+//    the original board) with where the report comes from, see
+//    docs/piuio.txt: the number of its scan, how many lamp frames had come
+//    in by then and how old the scan is when the PC asks. The PC can then
+//    tell a repeated report from a new one and how stale it is.
+//#define REPORT_META
+
+//    Uncomment to keep the last HISTORY_SIZE scans, so a game polling at
+//    60Hz can still get every scan done since its last read. They are read
+//    with a 0xC0 request with bRequest HISTORY_REQUEST, see docs/piuio.txt,
+//    and streamed from usbFunctionRead() straight out of the ring, so they
+//    need USB_CFG_IMPLEMENT_FN_READ set to 1 for the whole build, see
+//    usbconfig.h: usbdrv.c doesn't see this define. More than 62 frames in
+//    one transfer need USB_CFG_LONG_TRANSFERS as well.
+//#define INPUT_HISTORY
+#define HISTORY_REQUEST 0xB2
+#define HISTORY_SIZE 32                 //    Must be a power of two, up to 128
+
+//    Uncomment to scan the inputs at a fixed SCAN_RATE (in Hz) instead of on
+//    every loop. Timer2 ticks at that rate and loop() scans once per tick.
+//    The tick interrupt turns interrupts back on as its first instruction,
+//    so it never holds up V-USB; the scan itself stays in loop().
+//    Achieved rate, time between scans and overruns are in the statistics.
+//#define SCAN_TIMER
+#define SCAN_RATE 2000
+
+//    Uncomment to run the scan in slices of SCAN_SLICE steps (4067 channels),
+//    with the debounce, logs and report as a slice of their own, instead of
+//    a whole scan between two usbPoll(). loop() runs slices until the scan
+//    is done or POLL_BUDGET Timer1 ticks went by since usbPoll(), so a fast
+//    scan still takes one loop and a slow one (long MUX_SETTLE waits, more
+//    options) gives usbPoll() a turn in between. The longest time without
+//    usbPoll() is in the statistics either way.
+//#define SLICED_LOOP
+#define SCAN_SLICE 4
+#define POLL_BUDGET 25                  //    Timer1 ticks, 100us at 16MHz
+#ifdef SHIFT_INPUTS
+#define SCAN_STEPS 1                    //    One exchange reads them all
+#else
+#define SCAN_STEPS 16                   //    A 4067 channel each
+#endif
+
+//    Uncomment to write a marker to GPIOR0 when loop(), usbPoll(), the input
+//    scan and a lamp update start and end, so an AVR simulator can
+//    count AVR cycles between them. Each marker is one OUT instruction, the
+//    IDs are in piuio_marks.h
+//#define BENCH_MARKS
+#ifdef BENCH_MARKS
+#define MARK(id) (GPIOR0 = (id))
+#else
+#define MARK(id)
+#endif
 
 //    Some Vars to help
-static unsigned char LampData[8];       //    The LampData buffer received
-static unsigned char InputData[8];      //    The InputData buffer to send
+static unsigned char InputReports[2][8];        //    Two input reports, so a scan never writes the one being sent
+static unsigned char *InputData = InputReports[0];  //    The InputData buffer to send, always one whole scan
+static unsigned char *InputNext = InputReports[1];  //    The one pollInputOutput() fills
 static unsigned char datareceived = 0;  //    How many bytes we received
 static unsigned char dataLength = 0;    //    Total to receive
 
 static unsigned char Input[2];          //    The actual 16 bits Input data
-static unsigned char Output[4];         //    The actual 32 bits Output data
+#if USB_CFG_HAVE_INTRIN_ENDPOINT
+static unsigned char ReportData[8];     //    The last InputData pushed on the interrupt endpoint
+static unsigned char ReportPending = 1; //    InputData changed since then
+#endif
+static unsigned char OutputFrames[2][4];            //    Two lamp frames, the game writes straight into the back one
+static unsigned char *Output = OutputFrames[0];     //    The actual 32 bits Output data, always one whole frame
+static unsigned char *OutputNext = OutputFrames[1]; //    The frame usbFunctionWrite() fills
+static unsigned char LampNext[LAMP_CHAIN];  //    Bytes for the chain, in shifting order
+static unsigned char LampShift[LAMP_CHAIN]; //    The bytes being shifted now
+static unsigned char LampShiftPos = 0;  //    Next byte of LampShift to write, 0 when the SPI is idle
+static unsigned char LampDirty = 0;     //    LampNext changed since it was latched
+#ifdef SHIFT_INPUTS
+static unsigned char ShiftIn[INPUT_CHAIN];  //    Bytes of the 74HC165 chain, in shifting order
+#endif
+static unsigned char LatchedHalo = 0xFF;//    What is in the latches now. 0xFF is not a valid halo, so the first update latches
+static unsigned char LatchedPads = 0;
+static unsigned int LatchesDone = 0;    //    Lamp frames that changed the latches
+static unsigned int LatchesSkipped = 0; //    Lamp frames that would latch the same bits again
+static unsigned char LampFrames = 0;    //    Lamp frames received, wrapping
+static unsigned int Scans = 0;          //    Scans done, wrapping
+static unsigned int ScanOverruns = 0;   //    Timer2 ticks we were too busy to scan for
+static unsigned int ScanLast = 0;       //    Timer1 at the last scan
+static unsigned int ScanMin = 0xFFFF;   //    Shortest and longest time between two scans in Timer1
+static unsigned int ScanMax = 0;        //    ticks since the statistics were last read
+static unsigned int PollLast = 0;       //    Timer1 when usbPoll() last returned
+static unsigned int PollGapMax = 0;     //    Longest time without usbPoll() in Timer1 ticks since the statistics were last read
+static unsigned char StatsReport[14];    //    What we send to the PC on STATS_REQUEST
+#ifdef SLICED_LOOP
+static unsigned char ScanStep = 0;      //    Next scan step to read, SCAN_STEPS when only finishScan() is left
+#endif
+
+#ifdef SCAN_TIMER
+static volatile unsigned char ScanTicks = 0;    //    Timer2 ticks, counted by the interrupt
+static unsigned char ScanDone = 0;      //    Ticks already scanned for
+#endif
+
+#ifdef AUTO_MUX
+static unsigned char InputCache[4][2];  //    The 16 bits Input data for each muxer position
+static unsigned char MuxPosition = 0;   //    The muxer position being scanned
+#endif
+
+#ifdef MUX_SETTLE
+static unsigned char Settle[16];        //    Settle steps of each 4067 channel
+static unsigned char SettleNew[16];     //    The longest the calibration saw so far, 0xFF for nothing yet
+static unsigned char SettleMeasured = 0;    //    Channels the last calibration could measure
+static unsigned char CalibrateRounds = 0;   //    Rounds over the 16 channels left, 0 when not calibrating
+static unsigned char CalibrateChannel = 0;  //    Channel being measured
+static unsigned char CalibrateFrom;     //    Channel at the other level it is switched to from, 16 for none
+static unsigned char CalibrateRef;      //    What it reads settled
+static unsigned char CalibrateTrial = 0;    //    Next wait to try, 0 for a new channel
+static unsigned char CalibrateNeed;     //    Longest wait it read wrong after, + 1
+static unsigned char SettleSave = 0;    //    EEPROM bytes left to write
+static unsigned char SettleReport[18];  //    What we send to the PC on SETTLE_REQUEST
+#endif
+
+#ifdef DEBOUNCE
+struct debouncer    {                   //    8 inputs worth of vertical counters
+    unsigned char state;                //    The debounced bits
+    unsigned char c0, c1, c2;           //    Bit 0, 1 and 2 of each counter
+};
+#ifdef AUTO_MUX
+static struct debouncer Debounce[4][2]; //    Each muxer position has its own sensors
+#else
+static struct debouncer Debounce[1][2];
+#endif
+#if defined(SHIFT_INPUTS) && INPUT_CHAIN > 2
+static struct debouncer DebounceButtons[INPUT_CHAIN - 2];
+#endif
+#endif
+
+#ifdef INPUT_HISTORY
+#if !USB_CFG_IMPLEMENT_FN_READ
+#error INPUT_HISTORY needs USB_CFG_IMPLEMENT_FN_READ set to 1 in usbconfig.h or with -D for the whole build
+#endif
+#if (HISTORY_SIZE & (HISTORY_SIZE - 1)) || HISTORY_SIZE > 128
+#error HISTORY_SIZE must be a power of two, up to 128
+#endif
+#if HISTORY_SIZE > 62 && !USB_CFG_LONG_TRANSFERS
+#error A HISTORY_SIZE over 62 needs USB_CFG_LONG_TRANSFERS set to 1 in usbconfig.h
+#endif
+static unsigned char History[HISTORY_SIZE][4];  //    Scan number low byte, Timer1 high byte, input bytes 0 and 2
+static unsigned int HistorySend = 0;    //    Scan number of the next frame to send
+static unsigned int HistoryScans = 0;   //    Scans in History, behind Scans while a scan in slices is not finished
+static unsigned char HistoryHeader[4];  //    Scan number of the first frame sent, Timer1 at the request
+static unsigned char HistoryHeaderSent = 1;
+
+void recordHistory(unsigned int scan)    {
+  //    Keeps the scan that was just done, the oldest one goes
+  unsigned char *frame = History[scan & (HISTORY_SIZE - 1)];
+  frame[0] = scan & 0xFF;
+  frame[1] = ScanLast >> 8;                                        //    About 1ms per count
+  frame[2] = Input[0];
+  frame[3] = Input[1];
+  HistoryScans = scan + 1;
+}
+
+void startHistory(unsigned int first)    {
+  //    Gets a history read going from scan number first, or from the oldest
+  //    one still kept if that one is gone already
+  unsigned int stamp = TCNT1;
+  if((unsigned int)(HistoryScans - first) > HISTORY_SIZE)
+    first = HistoryScans - HISTORY_SIZE;
+  HistorySend = first;
+  HistoryHeader[0] = first & 0xFF;
+  HistoryHeader[1] = first >> 8;
+  HistoryHeader[2] = stamp & 0xFF;
+  HistoryHeader[3] = stamp >> 8;
+  HistoryHeaderSent = 0;
+}
+
+USB_PUBLIC uchar usbFunctionRead(uchar *data, uchar len)    {
+  //    V-USB asks for the history 8 bytes at a time, from usbPoll(). Only
+  //    whole frames go out, and only scans done already; a short packet ends
+  //    the transfer. Scans keep coming while it goes on, so if the frame
+  //    to send was overwritten meanwhile we skip to the oldest one left and
+  //    the PC sees the gap in the scan numbers.
+  unsigned char sent = 0;
+  unsigned char *frame;
+  if(!HistoryHeaderSent)    {
+    if(len < 4)
+      return 0;
+    for(; sent < 4; sent++)
+      data[sent] = HistoryHeader[sent];
+    HistoryHeaderSent = 1;
+  }
+  while(len - sent >= 4 && HistorySend != HistoryScans)    {
+    if((unsigned int)(HistoryScans - HistorySend) > HISTORY_SIZE)
+      HistorySend = HistoryScans - HISTORY_SIZE;
+    frame = History[HistorySend & (HISTORY_SIZE - 1)];
+    data[sent++] = frame[0];
+    data[sent++] = frame[1];
+    data[sent++] = frame[2];
+    data[sent++] = frame[3];
+    HistorySend++;
+  }
+  return sent;
+}
+#endif
+
+#ifdef EDGE_LOG
+static unsigned char EdgeLog[EDGE_LOG_SIZE][3]; //    Input number | level << 7, timestamp low, timestamp high
+static unsigned char EdgeHead = 0;      //    Next slot to write
+static unsigned char EdgeTail = 0;      //    Next slot to read
+static unsigned char EdgeLost = 0;      //    Edges dropped because the log was full
+static unsigned char EdgeReport[4 + EDGE_LOG_SIZE * 3];  //    What we send to the PC
+
+void logEdges(unsigned char first, unsigned char before, unsigned char now)    {
+  //    Logs every bit that changed between two scans of 8 inputs.
+  //    first is the input number of bit 0 (report byte * 8 + bit).
+  unsigned char changed = before ^ now;
+  unsigned int stamp = TCNT1;
+  for(unsigned char n = first; changed; n++, changed >>= 1, now >>= 1)    {
+    if(!(changed & 1))
+      continue;
+    if(((EdgeHead + 1) & (EDGE_LOG_SIZE - 1)) == EdgeTail)    {    //    Full, the PC is not reading
+      if(EdgeLost < 255)
+        EdgeLost++;
+      continue;
+    }
+    EdgeLog[EdgeHead][0] = n | ((now & 1) << 7);
+    EdgeLog[EdgeHead][1] = stamp & 0xFF;
+    EdgeLog[EdgeHead][2] = stamp >> 8;
+    EdgeHead = (EdgeHead + 1) & (EDGE_LOG_SIZE - 1);
+  }
+}
+
+unsigned char readEdges(unsigned char maxlen)    {
+  //    Moves as many edges as fit in maxlen bytes to EdgeReport.
+  //    Returns how many bytes to send.
+  unsigned int stamp = TCNT1;
+  unsigned char count = 0;
+  unsigned char *p = EdgeReport + 4;
+  if(maxlen < 4)
+    return 0;                                                   //    Not even the header fits, keep everything
+  while(EdgeTail != EdgeHead && maxlen - 4 - count * 3 >= 3)    {
+    *p++ = EdgeLog[EdgeTail][0];
+    *p++ = EdgeLog[EdgeTail][1];
+    *p++ = EdgeLog[EdgeTail][2];
+    EdgeTail = (EdgeTail + 1) & (EDGE_LOG_SIZE - 1);
+    count++;
+  }
+  EdgeReport[0] = count;
+  EdgeReport[1] = EdgeLost;
+  EdgeReport[2] = stamp & 0xFF;                                  //    Timer1 now, so the PC can place the edges in time
+  EdgeReport[3] = stamp >> 8;
+  EdgeLost = 0;
+  return 4 + count * 3;
+}
+#endif
+
+#ifdef DEBOUNCE
+#if DEBOUNCE_PRESS < 1 || DEBOUNCE_PRESS > 7 || DEBOUNCE_RELEASE < 1 || DEBOUNCE_RELEASE > 7
+#error DEBOUNCE_PRESS and DEBOUNCE_RELEASE must be from 1 to 7
+#endif
+//    Lanes of a vertical counter that hold the constant k
+#define COUNTER_IS(d,k) ((((k) & 1) ? (d)->c0 : ~(d)->c0) & (((k) & 2) ? (d)->c1 : ~(d)->c1) & (((k) & 4) ? (d)->c2 : ~(d)->c2))
+
+unsigned char debounce(struct debouncer *d, unsigned char raw)    {
+  //    Counts, for each bit, how many scans in a row raw disagreed with the
+  //    debounced state, and flips the state when it reaches the threshold.
+  unsigned char delta = raw ^ d->state;
+  unsigned char carry = delta;
+  unsigned char done;
+  d->c0 &= delta;                                                 //    Restart the bits that agree again
+  d->c1 &= delta;
+  d->c2 &= delta;
+  d->c0 ^= carry;    carry &= ~d->c0;                             //    Increment the ones that do not
+  d->c1 ^= carry;    carry &= ~d->c1;
+  d->c2 ^= carry;
+  done = (COUNTER_IS(d, DEBOUNCE_RELEASE) & ~d->state) | (COUNTER_IS(d, DEBOUNCE_PRESS) & d->state);    //    Down is 0
+  done &= delta;
+  d->state ^= done;
+  d->c0 &= ~done;
+  d->c1 &= ~done;
+  d->c2 &= ~done;
+  return d->state;
+}
+#endif
+
+void timeScan()    {
+  //    Keeps the scan statistics, called at the start of every scan
+  unsigned int now = TCNT1;
+  unsigned int interval = now - ScanLast;
+  ScanLast = now;
+  if(Scans)    {                                                   //    The first one has nothing to compare with
+    if(interval < ScanMin)
+      ScanMin = interval;
+    if(interval > ScanMax)
+      ScanMax = interval;
+  }
+  Scans++;
+}
+
+#ifdef SCAN_TIMER
+#if F_CPU / 32 / SCAN_RATE > 256 || F_CPU / 32 / SCAN_RATE < 16
+#error SCAN_RATE out of the Timer2 range
+#endif
+ISR(TIMER2_COMPA_vect, ISR_NOBLOCK)    {
+  ScanTicks++;
+}
+
+unsigned char scanDue()    {
+  //    1 if Timer2 ticked since the last scan. Extra ticks are overruns.
+  unsigned char ticks = ScanTicks;
+  if(ticks == ScanDone)
+    return 0;
+  ScanOverruns += (unsigned char)(ticks - ScanDone - 1);
+  ScanDone = ticks;
+  return 1;
+}
+#endif
+
+void serviceLamps()    {
+  //    Moves the lamp chain along: feeds SPDR when the last byte is out,
+  //    pulses the latch after the last one and starts over if the lamps
+  //    changed meanwhile. Cheap enough to call between input scan steps.
+  unsigned char i;
+  if(LampShiftPos)    {
+    if(!(SPSR & (1 << SPIF)))
+      return;                                                 //    Still shifting
+    if(LampShiftPos < LAMP_CHAIN)    {
+      SPDR = LampShift[LampShiftPos++];
+      return;
+    }
+    (void)SPDR;                                                //    Clears SPIF
+    SETBIT(PORTB,LATCH);
+    LampShiftPos = 0;
+  }
+  if(LampDirty)    {
+    for(i = 0; i < LAMP_CHAIN; i++)
+      LampShift[i] = LampNext[i];
+    LampDirty = 0;
+    CLRBIT(PORTB,LATCH);
+    SPDR = LampShift[0];
+    LampShiftPos = 1;
+  }
+}
+
+#ifdef SHIFT_INPUTS
+void shiftInputs()    {
+  //    Loads the 74HC165s and clocks their bytes into ShiftIn while the lamp
+  //    chain gets its bytes, in one exchange. The latch only moves when the
+  //    exchange carried a new lamp frame; otherwise the chain gets the bytes
+  //    it already shows again. The few bytes are waited for here, they take
+  //    less time than the 16 muxer steps did.
+  unsigned char i, dirty;
+  while(LampShiftPos)
+    serviceLamps();                                                //    Finish what updateLamps() started
+  dirty = LampDirty;
+  if(dirty)    {
+    for(i = 0; i < LAMP_CHAIN; i++)
+      LampShift[i] = LampNext[i];
+    LampDirty = 0;
+    CLRBIT(PORTB,LATCH);
+  }
+  CLRBIT(PORTB,INPUT_LOAD);                                        //    Takes the inputs in parallel
+  SETBIT(PORTB,INPUT_LOAD);
+  for(i = 0; i < SHIFT_BYTES; i++)    {
+    //    The inputs come in first, the lamp bytes go out last so they end up in the latches
+    SPDR = i < SHIFT_BYTES - LAMP_CHAIN ? 0xFF : LampShift[i - (SHIFT_BYTES - LAMP_CHAIN)];
+    while(!(SPSR & (1 << SPIF)))
+      ;
+    if(i < INPUT_CHAIN)
+      ShiftIn[i] = SPDR;
+    else
+      (void)SPDR;                                                  //    Clears SPIF
+  }
+  if(dirty)
+    SETBIT(PORTB,LATCH);
+}
+#endif
+
+#ifdef MUX_SETTLE
+static inline void settle(unsigned char steps)    {
+  //    About 4 cycles a step, the unit of the Settle table
+  while(steps--)
+    __asm__ __volatile__("nop");
+}
+
+void loadSettle()    {
+  //    The table from EEPROM, or no extra settle when it was never saved
+  unsigned char i;
+  if(eeprom_read_byte((uint8_t *)SETTLE_EEPROM) == SETTLE_MAGIC)
+    eeprom_read_block(Settle, (uint8_t *)SETTLE_EEPROM + 1, 16);
+  else
+    for(i = 0; i < 16; i++)
+      Settle[i] = 0;
+}
+
+void saveSettle()    {
+  //    Writes one byte of the table per call, when the EEPROM is done with
+  //    the last one, so the 3.3ms of each write never holds up usbPoll().
+  //    The magic goes first as 0 and last as SETTLE_MAGIC, so a table cut
+  //    short by a reset is not loaded.
+  if(!SettleSave || !eeprom_is_ready())
+    return;
+  SettleSave--;
+  if(SettleSave == 17)
+    eeprom_update_byte((uint8_t *)SETTLE_EEPROM, 0);
+  else if(SettleSave)
+    eeprom_update_byte((uint8_t *)SETTLE_EEPROM + SettleSave, Settle[SettleSave - 1]);
+  else
+    eeprom_update_byte((uint8_t *)SETTLE_EEPROM, SETTLE_MAGIC);
+}
+
+void finishCalibration()    {
+  //    Channels that never had a neighbour at the other level get the
+  //    longest of the others. If none had, nothing was learned.
+  unsigned char i, worst = 0;
+  SettleMeasured = 0;
+  for(i = 0; i < 16; i++)
+    if(SettleNew[i] != 0xFF)    {
+      SettleMeasured++;
+      if(SettleNew[i] > worst)
+        worst = SettleNew[i];
+    }
+  if(!SettleMeasured)
+    return;
+  for(i = 0; i < 16; i++)
+    Settle[i] = (SettleNew[i] == 0xFF ? worst : SettleNew[i]) + SETTLE_MARGIN;
+  SettleSave = 18;
+}
+
+void calibrateStep()    {
+  //    Measures one channel: switches to it from a channel that reads the
+  //    other level, waiting longer and longer before reading, and keeps
+  //    the wait after which it never read wrong. Interrupts stay on, so a
+  //    V-USB one can stretch a wait; that only ever hides a step, and the
+  //    rounds keep the longest. Called from loop(), CALIBRATE_TRIALS waits
+  //    at a time, so usbPoll() runs in between.
+  unsigned char muxbits = PORTC & 0xF0;                                   //    Leave the pad muxers alone
+  unsigned char n = CalibrateChannel, d, last;
+  if(!CalibrateTrial)    {
+    PORTC = muxbits | n;
+    settle(SETTLE_MAX);
+    CalibrateRef = GETBIT(PINB,0);
+    for(CalibrateFrom = 0; CalibrateFrom < 16; CalibrateFrom++)    {
+      PORTC = muxbits | CalibrateFrom;
+      settle(SETTLE_MAX);
+      if(GETBIT(PINB,0) != CalibrateRef)
+        break;
+    }
+    CalibrateNeed = 0;
+  }
+  last = CalibrateFrom < 16 && CalibrateTrial + CALIBRATE_TRIALS < SETTLE_MAX ? CalibrateTrial + CALIBRATE_TRIALS : SETTLE_MAX;
+  if(CalibrateFrom < 16)
+    for(d = CalibrateTrial; d < last; d++)    {
+      PORTC = muxbits | CalibrateFrom;
+      settle(SETTLE_MAX);
+      PORTC = muxbits | n;
+      settle(d);
+      if(GETBIT(PINB,0) != CalibrateRef)
+        CalibrateNeed = d + 1;
+    }
+  PORTC = muxbits;
+  CalibrateTrial = last;
+  if(CalibrateTrial < SETTLE_MAX)
+    return;
+  CalibrateTrial = 0;
+  if(CalibrateFrom < 16 && (SettleNew[n] == 0xFF || CalibrateNeed > SettleNew[n]))
+    SettleNew[n] = CalibrateNeed;
+  CalibrateChannel = (n + 1) & 15;
+  if(!CalibrateChannel && !--CalibrateRounds)
+    finishCalibration();
+}
+
+unsigned char readSettle(unsigned char rounds)    {
+  //    Fills SettleReport, returns how many bytes to send. A calibration of
+  //    that many rounds starts when rounds is not 0.
+  unsigned char i;
+  if(rounds)    {
+    for(i = 0; i < 16; i++)
+      SettleNew[i] = 0xFF;
+    CalibrateChannel = 0;
+    CalibrateTrial = 0;
+    CalibrateRounds = rounds;
+  }
+  for(i = 0; i < 16; i++)
+    SettleReport[i] = Settle[i];
+  SettleReport[16] = CalibrateRounds;
+  SettleReport[17] = SettleMeasured;
+  return 18;
+}
+#endif
+
+void updateLamps()    {
+  //    This will queue the lamps from Output for serviceLamps(). It is called
+  //    when a lamp frame arrives, so the latches only move when the game
+  //    changed something.
+
+  //in my version i use two 74hc595
+  //HERE WE FILTER THE BITS FROM THE GAME, openITG (see piuio_lamps.h)
+  unsigned char halo = LAMP_PROFILE::Halo::get(Output);
+  //first 4 bits are for player 1 , other 4 bits for player 2
+  unsigned char pads_lights = LAMP_PROFILE::Pads::get(Output);
+   //P1 and P2 are inverted here, but it,s not a real problem
+
+  if(halo == LatchedHalo && pads_lights == LatchedPads)    {      //    Same lamps, don't bother the latches
+    LatchesSkipped++;
+    return;
+  }
+  LatchedHalo = halo;
+  LatchedPads = pads_lights;
+  LatchesDone++;
+  //packets have to be inverted because DDR lights are active low
+  LampNext[0] = ~halo;
+  //first 74hc595 is for pads lights and second for cabinet lights
+  LampNext[1] = ~pads_lights;
+  for(unsigned char i = 2; i < LAMP_CHAIN; i++)
+    LampNext[i] = 0xFF;                                            //    Anything else on the chain stays off
+  //i decided to use shift register for cabinet and pad lights, used PORTC 0-3 for muxers pads 
+  LampDirty = 1;
+  serviceLamps();                                                  //    Start shifting now if the SPI is idle
+}
+
+unsigned char readStats()    {
+  //    Fills StatsReport, returns how many bytes to send
+  StatsReport[0] = LatchesDone & 0xFF;
+  StatsReport[1] = LatchesDone >> 8;
+  StatsReport[2] = LatchesSkipped & 0xFF;
+  StatsReport[3] = LatchesSkipped >> 8;
+  StatsReport[4] = Scans & 0xFF;
+  StatsReport[5] = Scans >> 8;
+  StatsReport[6] = ScanOverruns & 0xFF;
+  StatsReport[7] = ScanOverruns >> 8;
+  StatsReport[8] = ScanMin & 0xFF;
+  StatsReport[9] = ScanMin >> 8;
+  StatsReport[10] = ScanMax & 0xFF;
+  StatsReport[11] = ScanMax >> 8;
+  StatsReport[12] = PollGapMax & 0xFF;
+  StatsReport[13] = PollGapMax >> 8;
+  ScanMin = 0xFFFF;                                               //    A new window starts with each read
+  ScanMax = 0;
+  PollGapMax = 0;
+  return 14;
+}
+
+void commitLamps(unsigned char filled)    {
+  //    Makes OutputNext the frame everything reads, with a pointer swap, so
+  //    no one ever sees half a frame. Bytes a short write did not reach keep
+  //    their last value, as they did when the frame was copied.
+  unsigned char *frame = OutputNext;
+  for(; filled < 4; filled++)
+    frame[filled] = Output[filled];
+  OutputNext = Output;
+  Output = frame;
+  LampFrames++;
+  MARK(MARK_LAMPS);
+  updateLamps();                                                 //    Right away, not on the next loop
+  MARK(MARK_LAMPS | MARK_EXIT);
+}
 
 USB_PUBLIC uchar usbFunctionWrite(uchar *data, uchar len) {
   //    This function will be only triggered when game writes to the lamps output.
   unsigned char i;              
-  for(i = 0; datareceived < 8 && i < len; i++, datareceived++)
-    LampData[datareceived] = data[i];    
+  for(i = 0; i < len; i++, datareceived++)
+    if(datareceived < 4)
+      OutputNext[datareceived] = data[i];   //    The other bytes are just 0xFF junk
   if(datareceived == dataLength)    {    //    Time to set OUTPUT
-    //Output[0] = LampData[0];           //    The AM use unsigned short for those. 
-    //Output[1] = LampData[2];           //    So we just skip one byte
-    //    The other bytes are just 0xFF junk
-    Output[0] = LampData[0];
-    Output[1] = LampData[1];
-    Output[2] = LampData[2];
-    Output[3] = LampData[3];
+    commitLamps(datareceived);
   }    
   return (datareceived == dataLength);   // 1 if we received it all, 0 if not
 }
 
-USB_PUBLIC uchar usbFunctionSetup(uchar data[8]) {
+void pollInputOutput();                 //    Below, the combined request scans too
+
+#ifdef REPORT_META
+static unsigned int ReportScanLast = 0; //    Timer1 at the scan of InputData, ScanLast moves on when the next one starts
+
+void stampReport()    {
+  //    Puts how old the scan of InputData is now in its BYTE7, in 64us steps
+  unsigned int age = (TCNT1 - ReportScanLast) >> 4;
+  InputData[7] = age > 255 ? 255 : age;
+}
+#else
+#define stampReport()
+#endif
+
+USB_PUBLIC usbMsgLen_t usbFunctionSetup(uchar data[8]) {
   usbRequest_t *rq = (usbRequest_t *)data;
   if(rq->bRequest == 0xAE)    {                               //    Access Game IO
     switch(rq->bmRequestType)    {
@@ -63,62 +707,237 @@ USB_PUBLIC uchar usbFunctionSetup(uchar data[8]) {
       return USB_NO_MSG;                              //    Just tell we want a callback to usbFunctionWrite
       break;
     case 0xC0:                                          //    Reading input data
+      stampReport();
       usbMsgPtr = InputData;                          //    Just point to the buffer, and 
       return 8;                                       //    saying to send 8 bytes to the PC
       break;
     }
   }
+  if(rq->bRequest == COMBINED_REQUEST && rq->bmRequestType == 0xC0)    {  //    Lamps in, inputs out
+    OutputNext[0] = rq->wValue.bytes[0];
+    OutputNext[1] = rq->wValue.bytes[1];
+    OutputNext[2] = rq->wIndex.bytes[0];
+    OutputNext[3] = rq->wIndex.bytes[1];
+    commitLamps(4);
+    pollInputOutput();                                        //    With AUTO_MUX, answer with the sensor the new ZZ selects
+    stampReport();
+    usbMsgPtr = InputData;
+    return 8;
+  }
+  if(rq->bRequest == STATS_REQUEST && rq->bmRequestType == 0xC0)    { //    Clone statistics
+    usbMsgPtr = StatsReport;
+    return readStats();
+  }
+#ifdef EDGE_LOG
+  if(rq->bRequest == EDGE_REQUEST && rq->bmRequestType == 0xC0)    {  //    Drain the edge log
+    usbMsgPtr = EdgeReport;
+    return readEdges(rq->wLength.bytes[1] ? 255 : rq->wLength.bytes[0]);
+  }
+#endif
+#ifdef MUX_SETTLE
+  if(rq->bRequest == SETTLE_REQUEST && rq->bmRequestType == 0xC0)    {  //    Settle table, calibrate with wValue rounds
+    usbMsgPtr = SettleReport;
+    return readSettle(rq->wValue.bytes[0]);
+  }
+#endif
+#ifdef INPUT_HISTORY
+  if(rq->bRequest == HISTORY_REQUEST && rq->bmRequestType == 0xC0)    {  //    Scans since wValue
+    startHistory(rq->wValue.word);
+    return USB_NO_MSG;                                        //    Streamed by usbFunctionRead()
+  }
+#endif
   return 0;                                                   //    Ops, it cant get here
 }
 
-void pollInputOutput()    {
-  //    This will set outputs and get inputs
+void publishInput()    {
+  //    Makes the report pollInputOutput() just filled the one the PC gets.
+  //    Only the pointer changes hands, so a request always sees both players
+  //    from the same scan. The old report becomes the next one to fill; V-USB
+  //    copies usbMsgPtr out within the same usbPoll(), long before that.
+  unsigned char *filled = InputNext;
+  InputNext = InputData;
+  InputData = filled;
+#ifdef REPORT_META
+  ReportScanLast = ScanLast;
+#endif
+}
+
+void readInputs(unsigned char first, unsigned char end)    {
+  //    This will get inputs, the outputs are set by updateLamps()
   //    The board will use 4067 muxer that is 16-to-1 muxer.
   //    PORTC is the Muxer Selector.
   //    PORTB0 is the Muxer Output
-
+  //    Reads scan steps first to end - 1 into Input, see SCAN_STEPS.
+#ifdef SHIFT_INPUTS
+  (void)first;                                                          //    One step, the whole chain at once
+  (void)end;
+  shiftInputs();                                                        //    Pad muxers were set at the end of the last call
+  Input[0] = ShiftIn[0];
+  Input[1] = ShiftIn[1];
+#else
     unsigned int tmp1;    
+#ifdef AUTO_MUX
+  unsigned char muxbits = MuxPosition << MUX_SHIFT;                     //    Pad muxers were set at the end of the last call
+#else
+  unsigned char muxbits = 0;
+#endif
   //SETBIT(PORTB,3);                                                        //    Disable the latches input
-  for(int inputn=0;inputn<16;inputn++)    {
-    PORTC = inputn;                                                     //    Sets the muxer position
+#ifdef MUX_SETTLE
+  for(unsigned char step = first; step < end; step++)    {
+    unsigned char inputn = step ^ (step >> 1);                          //    Gray order, one select line moves at a time
+#else
+  for(unsigned char inputn = first; inputn < end; inputn++)    {
+#endif
+    PORTC = muxbits | inputn;                                           //    Sets the muxer position
+    serviceLamps();                                                     //    Next lamp byte while the muxer settles
+#ifdef MUX_SETTLE
+    settle(Settle[inputn]);                                             //    And what the calibration says it needs on top
+#endif
     tmp1 = GETBIT(PINB,0);                                             //    Gets the input
     if(tmp1 > 0)
       SETBIT(Input[(int)(inputn/8)],inputn%8);                          //    Sets if input = 1
     else
       CLRBIT(Input[(int)(inputn/8)],inputn%8);                          //    Clears if input = 0
   }
+#endif
+}
+
+void finishScan()    {
+  //    Everything after the reads: debounce, logs and the report
+#if defined(SHIFT_INPUTS) && INPUT_CHAIN > 2
+  unsigned char i;
+#endif
+#ifdef DEBOUNCE
+#ifdef AUTO_MUX
+  Input[0] = debounce(&Debounce[MuxPosition][0], Input[0]);
+  Input[1] = debounce(&Debounce[MuxPosition][1], Input[1]);
+#else
+  Input[0] = debounce(&Debounce[0][0], Input[0]);
+  Input[1] = debounce(&Debounce[0][1], Input[1]);
+#endif
+#endif
+#ifdef INPUT_HISTORY
+  recordHistory(Scans - 1);                                             //    timeScan() counted this one already
+#endif
   //InputData[0] ^= Input[0];
   //InputData[2] ^= Input[1];
 
-  //in my version i use two 74hc595
-  //HERE WE FILTER THE BITS FROM THE GAME, openITG
-  unsigned char neon_bit = Output[1] & 0b00000100;
-  unsigned char cabinet_buttons = Output[1] & 0b00011000;
-  unsigned char halo = (Output[3] & 0b00000111) | ((Output[2] & 0b10000000)>> 4 );
-  halo |= neon_bit << 2;
-  halo |= cabinet_buttons << 2;
-
-  //first 4 bits are for player 1 , other 4 bits for player 2
-  unsigned char pads_lights = Output[0] & 0b00111100;
-  pads_lights = pads_lights << 2;
-  pads_lights |= (Output[2] & 0b00111100) >> 2;  
-   //P1 and P2 are inverted here, but it,s not a real problem
-  //unsigned char muxers = Output[0] & 3 | ((Output[2] & 3 ) << 2);
-
-  CLRBIT(PORTB,LATCH);
-  //packets have to be inverted because DDR lights are active low
-  SPI.transfer(~halo);
-  //first 74hc595 is for pads lights and second for cabinet lights
-  SPI.transfer(~pads_lights);
-  //i decided to use shift register for cabinet and pad lights, used PORTC 0-3 for muxers pads 
-  SETBIT(PORTB,LATCH);
   //PORTC = muxers; //uncomment this if you need muxers on pad, but watchout at the conflicts when you take the input from the pads
   //    Okay, so now we can set the output buffer, just in case the PC asks now the inputs
-  InputData[0] = Input[0];    
-  InputData[2] = Input[1];
+#ifdef AUTO_MUX
+#ifdef EDGE_LOG
+  logEdges(MuxPosition << 5, InputCache[MuxPosition][0], Input[0]);
+  logEdges((MuxPosition << 5) | 16, InputCache[MuxPosition][1], Input[1]);
+#endif
+  InputCache[MuxPosition][0] = Input[0];
+  InputCache[MuxPosition][1] = Input[1];
+  MuxPosition = (MuxPosition + 1) & 3;
+  PORTC = MuxPosition << MUX_SHIFT;                                     //    Switch the pad muxers now, so they settle while we do usbPoll()
+#ifdef AUTO_MUX_MERGE
+  InputNext[0] = InputCache[0][0] & InputCache[1][0] & InputCache[2][0] & InputCache[3][0];   //    Down is 0 in the report
+  InputNext[2] = InputCache[0][1] & InputCache[1][1] & InputCache[2][1] & InputCache[3][1];
+#else
+  InputNext[0] = InputCache[Output[0] & 3][0];                          //    ZZ of P1
+  InputNext[2] = InputCache[Output[2] & 3][1];                          //    ZZ of P2
+#endif
+#else
+#ifdef EDGE_LOG
+  logEdges(0, InputData[0], Input[0]);
+  logEdges(16, InputData[2], Input[1]);
+#endif
+  InputNext[0] = Input[0];    
+  InputNext[2] = Input[1];
+#endif
+#if defined(SHIFT_INPUTS) && INPUT_CHAIN > 2
+  for(i = 2; i < INPUT_CHAIN; i++)    {                                 //    The buttons, BYTE1 and BYTE3
+    unsigned char buttons = ShiftIn[i];
+#ifdef DEBOUNCE
+    buttons = debounce(&DebounceButtons[i - 2], buttons);
+#endif
+#ifdef EDGE_LOG
+    logEdges((i - 2) * 16 + 8, InputData[(i - 2) * 2 + 1], buttons);
+#endif
+    InputNext[(i - 2) * 2 + 1] = buttons;
+  }
+#endif
+#ifdef REPORT_META
+  InputNext[4] = (Scans - 1) & 0xFF;                                    //    timeScan() counted this one already
+  InputNext[5] = (Scans - 1) >> 8;
+  InputNext[6] = LampFrames;
+#endif
+  publishInput();
+}
 
+void pollInputOutput()    {
+  //    A whole scan at once, or the rest of the one loop() is doing in slices
+  MARK(MARK_SCAN);
+#ifdef SLICED_LOOP
+  if(ScanStep)    {                                                     //    timeScan() counted it already
+    if(ScanStep < SCAN_STEPS)
+      readInputs(ScanStep, SCAN_STEPS);
+    ScanStep = 0;
+  } else    {
+    timeScan();
+    readInputs(0, SCAN_STEPS);
+  }
+#else
+  timeScan();
+  readInputs(0, SCAN_STEPS);
+#endif
+  finishScan();
+  MARK(MARK_SCAN | MARK_EXIT);
 }
 
+#ifdef SLICED_LOOP
+void scanSlice()    {
+  //    One slice of the scan: SCAN_SLICE steps of reads, or the bookkeeping
+  //    after the last one. A slice is the longest loop() runs without usbPoll().
+  MARK(MARK_SCAN);
+  if(ScanStep < SCAN_STEPS)    {
+    if(!ScanStep)
+      timeScan();
+    unsigned char end = ScanStep + SCAN_SLICE < SCAN_STEPS ? ScanStep + SCAN_SLICE : SCAN_STEPS;
+    readInputs(ScanStep, end);
+    ScanStep = end;
+  } else    {
+    finishScan();
+    ScanStep = 0;
+  }
+  MARK(MARK_SCAN | MARK_EXIT);
+}
+
+void runSlices()    {
+  //    Slices until the scan is done or POLL_BUDGET is used up, at least one
+#ifdef SCAN_TIMER
+  if(!ScanStep && !scanDue())
+    return;
+#endif
+  do
+    scanSlice();
+  while(ScanStep && (unsigned int)(TCNT1 - PollLast) < POLL_BUDGET);
+}
+#endif
+
+
+#if USB_CFG_HAVE_INTRIN_ENDPOINT
+void sendInputChanges()    {
+  //    Pushes InputData on the interrupt-in endpoint, but only when it changed.
+  //    If the last report was not fetched by the host yet, we keep it pending
+  //    and send the newest state as soon as the endpoint is free.
+  //    Only the inputs count as a change, REPORT_META moves with every scan.
+  unsigned char i;
+  for(i = 0; i < 4; i++)
+    if(ReportData[i] != InputData[i])
+      ReportPending = 1;
+  if(ReportPending && usbInterruptIsReady())    {
+    stampReport();
+    for(i = 0; i < 8; i++)
+      ReportData[i] = InputData[i];
+    usbSetInterrupt(ReportData, 8);
+    ReportPending = 0;
+  }
+}
+#endif
 
 void setup() {
   unsigned char i;
@@ -126,21 +945,77 @@ void setup() {
   PORTC = 0;
   DDRB = 0b00111110;
   PORTB = 0;
-  for(i=0;i<8;i++)
-    InputData[i] = 0xFF;
+  for(i=0;i<8;i++)    {
+    InputReports[0][i] = 0xFF;
+    InputReports[1][i] = 0xFF;
+  }
+#ifdef INPUT_HISTORY
+  for(i = 0; i < HISTORY_SIZE; i++)    {      // the scans before the first one had nothing pressed
+    History[i][0] = i - HISTORY_SIZE;
+    History[i][2] = 0xFF;
+    History[i][3] = 0xFF;
+  }
+#endif
   usbInit();
   usbDeviceDisconnect();                      // enforce re-enumeration
   for(i = 0; i<250; i++) {                    // wait 500 ms
     delayMicroseconds(100);
   }
   usbDeviceConnect();
+  TCCR1A = 0;                                 // Timer1 free running at F_CPU/64 for timestamps
+  TCCR1B = (1 << CS11) | (1 << CS10);
+#ifdef SCAN_TIMER
+  TCCR2A = (1 << WGM21);                      // Timer2 ticks at SCAN_RATE to pace the input scan
+  TCCR2B = (1 << CS21) | (1 << CS20);         // F_CPU/32
+  OCR2A = F_CPU / 32 / SCAN_RATE - 1;
+  TIMSK2 = (1 << OCIE2A);
+#endif
   SPI.begin();
   SPI.setBitOrder(LSBFIRST);
+#ifdef SHIFT_INPUTS
+  SETBIT(PORTB,INPUT_LOAD);                   // the 74HC165s shift while it is high
+#endif
+#ifdef MUX_SETTLE
+  loadSettle();
+#endif
+  updateLamps();                              // all lamps off until the game says otherwise
 
 }
 
-void loop() {
+void pollUsb()    {
+  //    usbPoll(), keeping the longest time since it last returned
+  unsigned int gap = TCNT1 - PollLast;
+  if(gap > PollGapMax)
+    PollGapMax = gap;
+  MARK(MARK_USBPOLL);
   usbPoll();
+  MARK(MARK_USBPOLL | MARK_EXIT);
+  PollLast = TCNT1;
+}
+
+void loop() {
+  MARK(MARK_LOOP);
+  pollUsb();
+  serviceLamps();
+#ifdef MUX_SETTLE
+  if(CalibrateRounds)
+    calibrateStep();
+  saveSettle();
+#endif
+#ifdef SLICED_LOOP
+  runSlices();
+#else
+#ifdef SCAN_TIMER
+  if(!scanDue())    {
+    MARK(MARK_LOOP | MARK_EXIT);
+    return;
+  }
+#endif
   pollInputOutput();
+#endif
+#if USB_CFG_HAVE_INTRIN_ENDPOINT
+  sendInputChanges();
+#endif
+  MARK(MARK_LOOP | MARK_EXIT);
 }
 
@@ -21,6 +21,8 @@
 #include <avr/wdt.h>
 #include <avr/pgmspace.h>
 #include <SPI.h> //for faster shift register
+#include <piuio_lamps.h>
+#include <piuio_marks.h>
 //    Some Macros to help
 
 #define GETBIT(port,_bit) ((port) & (0x01 << (_bit)))     //    Get Byte bit
@@ -28,29 +30,144 @@
 #define CLRBIT(port,_bit) ((port) &= ~(0x01 << (_bit)))   //    Clr Byte bit
 //PORTB pins for shift register
 #define LATCH 2
+//    How the OpenITG lamp bits map to our latches and muxers, see piuio_lamps.h
+#define LAMP_PROFILE LightsOnlyLamps
+//    74HC595s in the lamp chain. The bytes are shifted by writing SPDR and
+//    feeding the next one once the SPI is done, from serviceLamps(), so the
+//    loop never waits on the SPI. An SPI interrupt could do the feeding too,
+//    but any other interrupt delays the V-USB one, so we poll instead.
+#define LAMP_CHAIN 2
+#if LAMP_CHAIN < 2
+#error The halo and pad lamps need at least two 74HC595
+#endif
+
+//    bRequest of the clone statistics read (0xC0), see docs/piuio.txt
+#define STATS_REQUEST 0xB0
+//    bRequest of the combined lamp write and input read (0xC0). The lamp
+//    bytes come in wValue/wIndex and the reply is the 0xAE input report,
+//    so one transfer does what a 0x40 write and a 0xC0 read do.
+#define COMBINED_REQUEST 0xB1
+
+//    Uncomment to write a marker to GPIOR0 when loop(), usbPoll(), the input
+//    scan and a lamp update start and end, so an AVR simulator can
+//    count AVR cycles between them. Each marker is one OUT instruction, the
+//    IDs are in piuio_marks.h
+//#define BENCH_MARKS
+#ifdef BENCH_MARKS
+#define MARK(id) (GPIOR0 = (id))
+#else
+#define MARK(id)
+#endif
 
 //    Some Vars to help
-static unsigned char LampData[8];       //    The LampData buffer received
 static unsigned char InputData[8];      //    The InputData buffer to send
 static unsigned char datareceived = 0;  //    How many bytes we received
 static unsigned char dataLength = 0;    //    Total to receive
-static unsigned char Output[4];         //    The actual 32 bits Output data
+static unsigned char OutputFrames[2][4];            //    Two lamp frames, the game writes straight into the back one
+static unsigned char *Output = OutputFrames[0];     //    The actual 32 bits Output data, always one whole frame
+static unsigned char *OutputNext = OutputFrames[1]; //    The frame usbFunctionWrite() fills
+static unsigned char LampNext[LAMP_CHAIN];  //    Bytes for the chain, in shifting order
+static unsigned char LampShift[LAMP_CHAIN]; //    The bytes being shifted now
+static unsigned char LampShiftPos = 0;  //    Next byte of LampShift to write, 0 when the SPI is idle
+static unsigned char LampDirty = 0;     //    LampNext changed since it was latched
+static unsigned char LatchedHalo = 0xFF;//    What is in the latches now. 0xFF is not a valid halo, so the first update latches
+static unsigned char LatchedPads = 0;
+static unsigned int LatchesDone = 0;    //    Lamp frames that changed the latches
+static unsigned int LatchesSkipped = 0; //    Lamp frames that would latch the same bits again
+static unsigned char StatsReport[4];    //    What we send to the PC on STATS_REQUEST
+
+void serviceLamps()    {
+    //    Moves the lamp chain along: feeds SPDR when the last byte is out,
+    //    pulses the latch after the last one and starts over if the lamps
+    //    changed meanwhile. Cheap enough to call between input scan steps.
+    unsigned char i;
+    if(LampShiftPos)    {
+        if(!(SPSR & (1 << SPIF)))
+            return;                                                 //    Still shifting
+        if(LampShiftPos < LAMP_CHAIN)    {
+            SPDR = LampShift[LampShiftPos++];
+            return;
+        }
+        (void)SPDR;                                                //    Clears SPIF
+        SETBIT(PORTB,LATCH);
+        LampShiftPos = 0;
+    }
+    if(LampDirty)    {
+        for(i = 0; i < LAMP_CHAIN; i++)
+            LampShift[i] = LampNext[i];
+        LampDirty = 0;
+        CLRBIT(PORTB,LATCH);
+        SPDR = LampShift[0];
+        LampShiftPos = 1;
+    }
+}
+
+void updateLamps()    {
+    //    This will set the pad muxers and queue the lamps from Output for
+    //    serviceLamps(). It is called when a lamp frame arrives, so the
+    //    latches only move when something changed.
+    
+    //in my version i use two 74hc595 and SPI for control them
+    //the bits from the game are filtered by the profile in piuio_lamps.h
+    unsigned char halo = LAMP_PROFILE::Halo::get(Output);
+    unsigned char pads_lights = LAMP_PROFILE::Pads::get(Output);
+    unsigned char muxers = LAMP_PROFILE::Muxers::get(Output);
+    PORTC = muxers;                                                 //    The muxers don't go through the latches
+    
+    if(halo == LatchedHalo && pads_lights == LatchedPads)    {      //    Same lamps, don't bother the latches
+        LatchesSkipped++;
+        return;
+    }
+    LatchedHalo = halo;
+    LatchedPads = pads_lights;
+    LatchesDone++;
+    //packets have to be inverted because DDR lights are active low
+    LampNext[0] = ~halo;
+    //first 74hc595 is for pads lights and second for cabinet lights
+    LampNext[1] = ~pads_lights;
+    for(unsigned char i = 2; i < LAMP_CHAIN; i++)
+        LampNext[i] = 0xFF;                                            //    Anything else on the chain stays off
+    //i decided to use shift register for cabinet and pad lights, used PORTC 0-3 for muxers pads 
+    LampDirty = 1;
+    serviceLamps();                                                  //    Start shifting now if the SPI is idle
+}
+
+unsigned char readStats()    {
+    //    Fills StatsReport, returns how many bytes to send
+    StatsReport[0] = LatchesDone & 0xFF;
+    StatsReport[1] = LatchesDone >> 8;
+    StatsReport[2] = LatchesSkipped & 0xFF;
+    StatsReport[3] = LatchesSkipped >> 8;
+    return 4;
+}
+
+void commitLamps(unsigned char filled)    {
+    //    Makes OutputNext the frame everything reads, with a pointer swap, so
+    //    no one ever sees half a frame. Bytes a short write did not reach keep
+    //    their last value, as they did when the frame was copied.
+    unsigned char *frame = OutputNext;
+    for(; filled < 4; filled++)
+        frame[filled] = Output[filled];
+    OutputNext = Output;
+    Output = frame;
+    MARK(MARK_LAMPS);
+    updateLamps();                                                 //    Right away, not on the next loop
+    MARK(MARK_LAMPS | MARK_EXIT);
+}
 
 USB_PUBLIC uchar usbFunctionWrite(uchar *data, uchar len) {
     //    This function will be only triggered when game writes to the lamps output.
     unsigned char i;              
-    for(i = 0; datareceived < 8 && i < len; i++, datareceived++)
-               LampData[datareceived] = data[i];    
+    for(i = 0; i < len; i++, datareceived++)
+        if(datareceived < 4)
+            OutputNext[datareceived] = data[i];   //    The other bytes are just 0xFF junk
     if(datareceived == dataLength)    {    //    Time to set OUTPUT
-        Output[0] = LampData[0];
-        Output[1] = LampData[1];
-        Output[2] = LampData[2];
-        Output[3] = LampData[3];
+        commitLamps(datareceived);
     }    
     return (datareceived == dataLength);   // 1 if we received it all, 0 if not
 }
 
-USB_PUBLIC uchar usbFunctionSetup(uchar data[8]) {
+USB_PUBLIC usbMsgLen_t usbFunctionSetup(uchar data[8]) {
     usbRequest_t *rq = (usbRequest_t *)data;
     if(rq->bRequest == 0xAE)    {                               //    Access Game IO
         switch(rq->bmRequestType)    {
@@ -65,36 +182,22 @@ USB_PUBLIC uchar usbFunctionSetup(uchar data[8]) {
             break;
         }
     }
+    if(rq->bRequest == COMBINED_REQUEST && rq->bmRequestType == 0xC0)    {  //    Lamps in, inputs out
+        OutputNext[0] = rq->wValue.bytes[0];
+        OutputNext[1] = rq->wValue.bytes[1];
+        OutputNext[2] = rq->wIndex.bytes[0];
+        OutputNext[3] = rq->wIndex.bytes[1];
+        commitLamps(4);                                         //    No inputs on this board, the report is junk
+        usbMsgPtr = InputData;
+        return 8;
+    }
+    if(rq->bRequest == STATS_REQUEST && rq->bmRequestType == 0xC0)    { //    Clone statistics
+        usbMsgPtr = StatsReport;
+        return readStats();
+    }
     return 0;                                                   //    Ops, it cant get here
 }
 
-void pollInputOutput()    {
-
-    
-    //in my version i use two 74hc595 and SPI for control them
-    unsigned char neon_bit = Output[1] & 0b00000100;
-    unsigned char cabinet_buttons = Output[1] & 0b00011000;
-    unsigned char halo = (Output[3] & 0b00000111) | ((Output[2] & 0b10000000)>> 4 );
-    halo |= neon_bit << 2;
-    halo |= cabinet_buttons << 2;
-    
-    unsigned char pads_lights = Output[0] & 0b00111100;
-    pads_lights = pads_lights >> 2;
-    pads_lights |= (Output[2] & 0b00111100) << 2;  
-    
-    unsigned char muxers = Output[0] & 3 | ((Output[2] & 3 ) << 2);
-    
-    CLRBIT(PORTB,LATCH);
-    //packets have to be inverted because DDR lights are active low
-    SPI.transfer(~halo);
-    //first 74hc595 is for pads lights and second for cabinet lights
-    SPI.transfer(~pads_lights);
-    //i decided to use shift register for cabinet and pad lights, used PORTC 0-3 for muxers pads 
-    SETBIT(PORTB,LATCH);
-    PORTC = muxers;
-}
-
-
 void setup() {
     unsigned char i;
     wdt_enable(WDTO_1S);
@@ -114,11 +217,16 @@ void setup() {
     usbDeviceConnect();
     SPI.begin();
     SPI.setBitOrder(LSBFIRST);
+    updateLamps();                              // all lamps off until the game says otherwise
 
 }
 
 void loop() {
+        MARK(MARK_LOOP);
         wdt_reset();                            // keep the watchdog happy
-        usbPoll();
-        pollInputOutput();
+        MARK(MARK_USBPOLL);
+        usbPoll();                              // lamps are queued from usbFunctionWrite()
+        MARK(MARK_USBPOLL | MARK_EXIT);
+        serviceLamps();
+        MARK(MARK_LOOP | MARK_EXIT);
 }
@@ -59,20 +59,23 @@
 // There is too many stuff here lol, so I will just comment a few of these and also if its not default value, I will say why I changed.
 // You can look what each one does at the original usbconfig from V-USB
 
-#define USB_CFG_HAVE_INTRIN_ENDPOINT    0       //  We dont need any additional entry points, so this will be 0
+#define USB_CFG_HAVE_INTRIN_ENDPOINT    0       //  Set to 1 to also push input changes on the interrupt-in endpoint 1 (see sendInputChanges() in the sketch).
+                                                //  OpenITG only uses the 0xAE control requests, and those keep working either way
 #define USB_CFG_HAVE_INTRIN_ENDPOINT3   0       //  Same as below
 #define USB_CFG_EP3_NUMBER              3       //  The Entrypoint 3 number. We dont need it, so we keep default.
 #define USB_CFG_IMPLEMENT_HALT          0       //  Thats for interrupting a endpoint. We dont need it
 #define USB_CFG_SUPPRESS_INTR_CODE      0       
-#define USB_CFG_INTR_POLL_INTERVAL      10
+#define USB_CFG_INTR_POLL_INTERVAL      10      //  Interrupt-in poll interval in ms. 10 is the lowest a low speed device can ask for
 #define USB_CFG_IS_SELF_POWERED         0       //  PIUIO does have own power supply. But I dont like that lol, so mine is just USB powered.
 #define USB_CFG_MAX_BUS_POWER           1000     //  This is the value in mA, it will be divided by two (100 mean 50mA). Its just an info for PC
 #define USB_CFG_IMPLEMENT_FN_WRITE      1       //  We implemented a write-from-computer function. This is basicly used when game writes the lamp data.
-#define USB_CFG_IMPLEMENT_FN_READ       0       //  We dont need to implement that. The stuff that V-USB provides to us is all we need.
+#ifndef USB_CFG_IMPLEMENT_FN_READ              //  usbdrv.c is built apart from the sketch and never sees its defines, so this is its own switch
+#define USB_CFG_IMPLEMENT_FN_READ       0       //  Set to 1 (here, or -DUSB_CFG_IMPLEMENT_FN_READ=1 for the whole build) together with INPUT_HISTORY in piuio_clone,
+#endif                                          //  which streams it from usbFunctionRead(). piuio_lights_only has none, keep it 0 for that one
 #define USB_CFG_IMPLEMENT_FN_WRITEOUT   0
 #define USB_CFG_HAVE_FLOWCONTROL        0
 #define USB_CFG_DRIVER_FLASH_PAGE       0
-#define USB_CFG_LONG_TRANSFERS          0
+#define USB_CFG_LONG_TRANSFERS          0       //  Set to 1 for a HISTORY_SIZE over 62 (INPUT_HISTORY in the clone)
 #define USB_COUNT_SOF                   0
 #define USB_CFG_CHECK_DATA_TOGGLING     0
 #define USB_CFG_HAVE_MEASURE_FRAME_LENGTH   0
@@ -0,0 +1,108 @@
+/***********************************************************/
+/*    Lamp mapping bench for piuio_lamps.h                 */
+/***********************************************************/
+/*    Checks every board profile against the shift and     */
+/*    mask code the sketches had written by hand, over     */
+/*    every value of the Output[] bytes each lamp byte     */
+/*    depends on, then times both. The times are host      */
+/*    times and say nothing about AVR cycles or code size. */
+/*                                                         */
+/*    Build from the repository root:                      */
+/*      g++ -O2 -std=c++11 -Ipiuio \                       */
+/*          host/bench/lamp_bench.cpp -o lamp_bench        */
+/*    Run: ./lamp_bench                                    */
+/***********************************************************/
+#include <piuio_lamps.h>
+
+#include <stdio.h>
+#include <chrono>
+
+//    The mapping as it was written in the sketches before piuio_lamps.h
+struct HandWritten    {
+    static unsigned char halo(const unsigned char *Output)    {
+        unsigned char neon_bit = Output[1] & 0b00000100;
+        unsigned char cabinet_buttons = Output[1] & 0b00011000;
+        unsigned char halo = (Output[3] & 0b00000111) | ((Output[2] & 0b10000000)>> 4 );
+        halo |= neon_bit << 2;
+        halo |= cabinet_buttons << 2;
+        return halo;
+    }
+    static unsigned char clonePads(const unsigned char *Output)    {
+        unsigned char pads_lights = Output[0] & 0b00111100;
+        pads_lights = pads_lights << 2;
+        pads_lights |= (Output[2] & 0b00111100) >> 2;
+        return pads_lights;
+    }
+    static unsigned char lightsPads(const unsigned char *Output)    {
+        unsigned char pads_lights = Output[0] & 0b00111100;
+        pads_lights = pads_lights >> 2;
+        pads_lights |= (Output[2] & 0b00111100) << 2;
+        return pads_lights;
+    }
+    static unsigned char lightsMuxers(const unsigned char *Output)    {
+        return (Output[0] & 3) | ((Output[2] & 3 ) << 2);
+    }
+};
+
+static unsigned long failures = 0;
+
+static void expect(const char *what, const unsigned char *out, unsigned char got, unsigned char want)    {
+    if(got == want)
+        return;
+    if(failures++ < 10)
+        printf("MISMATCH %s: Output %02X %02X %02X %02X gives %02X, hand written %02X\n",
+               what, out[0], out[1], out[2], out[3], got, want);
+}
+
+static void verify()    {
+    unsigned char out[4] = { 0, 0, 0, 0 };
+    //    Halo reads Output[1..3]
+    for(unsigned long v = 0; v < 0x1000000; v++)    {
+        out[1] = v;
+        out[2] = v >> 8;
+        out[3] = v >> 16;
+        expect("halo", out, HaloLamps::get(out), HandWritten::halo(out));
+    }
+    //    Pads and muxers read Output[0] and Output[2]
+    out[1] = out[3] = 0;
+    for(unsigned v = 0; v < 0x10000; v++)    {
+        out[0] = v;
+        out[2] = v >> 8;
+        expect("clone pads", out, CloneLamps::Pads::get(out), HandWritten::clonePads(out));
+        expect("mega pads", out, MegaLamps::Pads::get(out), HandWritten::clonePads(out));
+        expect("lights pads", out, LightsOnlyLamps::Pads::get(out), HandWritten::lightsPads(out));
+        expect("lights muxers", out, LightsOnlyLamps::Muxers::get(out), HandWritten::lightsMuxers(out));
+    }
+}
+
+typedef std::chrono::steady_clock Clock;
+
+template<class Fn> static double time(Fn fn)    {
+    static volatile unsigned char sink __attribute__((unused));
+    unsigned char out[4];
+    const unsigned long n = 50000000;
+    Clock::time_point t = Clock::now();
+    for(unsigned long i = 0; i < n; i++)    {
+        out[0] = i;
+        out[1] = i >> 3;
+        out[2] = i >> 5;
+        out[3] = i >> 7;
+        sink = fn(out);
+    }
+    return std::chrono::duration<double>(Clock::now() - t).count() * 1e9 / n;
+}
+
+int main()    {
+    verify();
+    printf("%s: %lu mismatches\n", failures ? "FAIL" : "ok", failures);
+
+    printf("halo          table %5.2f ns   hand written %5.2f ns\n",
+           time(HaloLamps::get), time(HandWritten::halo));
+    printf("clone pads    table %5.2f ns   hand written %5.2f ns\n",
+           time(CloneLamps::Pads::get), time(HandWritten::clonePads));
+    printf("lights pads   table %5.2f ns   hand written %5.2f ns\n",
+           time(LightsOnlyLamps::Pads::get), time(HandWritten::lightsPads));
+    printf("lights muxers table %5.2f ns   hand written %5.2f ns\n",
+           time(LightsOnlyLamps::Muxers::get), time(HandWritten::lightsMuxers));
+    return failures ? 1 : 0;
+}
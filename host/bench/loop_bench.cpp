@@ -0,0 +1,148 @@
+/***********************************************************/
+/*    loop() rate bench for the three sketches             */
+/***********************************************************/
+/*    Builds every sketch against the host simulation in   */
+/*    host/sim and reports how fast loop() spins and what  */
+/*    pollInputOutput() (updateLamps() for lights-only)    */
+/*    costs per call. The numbers are                      */
+/*    host numbers, not AVR cycles, so only compare them   */
+/*    against runs of the same bench on the same machine.  */
+/*                                                         */
+/*    Build from the repository root:                      */
+/*      g++ -O2 -std=c++11 -Ihost/sim -Ipiuio \            */
+/*          -IArduino_uno host/sim/sim.cpp \               */
+/*          host/bench/loop_bench.cpp -o loop_bench        */
+/*    Run: ./loop_bench [iterations]                       */
+/***********************************************************/
+#include <Arduino.h>
+#include <SPI.h>
+#include <usbdrv.h>
+#include <avr/wdt.h>
+#include <avr/pgmspace.h>
+#include <avr/eeprom.h>
+#include <piuio_lamps.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+
+namespace uno {
+#include "../../Arduino_uno/piuio_clone/piuio_clone.ino"
+}
+#undef LAMP_PROFILE
+namespace mega {
+#include "../../Arduino_mega/piuio_clone/piuio_clone.ino"
+}
+#undef LAMP_PROFILE
+namespace lights {
+#include "../../Arduino_uno/piuio_lights_only/piuio_lights_only.ino"
+}
+
+#ifdef SCAN_TIMER
+#define TIMER2(ns) ns::TIMER2_COMPA_vect
+#else
+#define TIMER2(ns) 0
+#endif
+
+#ifdef INPUT_HISTORY
+#define HISTORY_READ(ns) ns::usbFunctionRead
+#else
+#define HISTORY_READ(ns) 0
+#endif
+
+static const sim::Board Boards[] = {
+    { "uno",    uno::setup,    uno::loop,    uno::pollInputOutput,    uno::usbFunctionSetup,    uno::usbFunctionWrite,    HISTORY_READ(uno), TIMER2(uno) },
+    { "mega",   mega::setup,   mega::loop,   mega::pollInputOutput,   mega::usbFunctionSetup,   mega::usbFunctionWrite,   0, TIMER2(mega) },
+    { "lights", lights::setup, lights::loop, lights::updateLamps, lights::usbFunctionSetup, lights::usbFunctionWrite, 0, 0 },
+};
+
+//    Pad state seen through the wiring, changed by the bench as it goes
+static uint16_t Pads = 0xA5C3;
+
+//    Uno: PORTC selects one of 16 inputs on the 4067, the output is PINB0
+static uint8_t readMuxedPinB(uint8_t value)    {
+    return (value & 0xFE) | ((Pads >> (PORTC.value & 0x0F)) & 1);
+}
+
+//    Mega: one port per player, operator buttons on PING
+static uint8_t readPinF(uint8_t)    { return Pads & 0xFF; }
+static uint8_t readPinK(uint8_t)    { return Pads >> 8; }
+
+static void wire()    {
+    PINB.onRead = readMuxedPinB;
+    PINF.onRead = readPinF;
+    PINK.onRead = readPinK;
+    PING.value = 0x07;
+}
+
+typedef std::chrono::steady_clock Clock;
+
+static double seconds(Clock::time_point since)    {
+    return std::chrono::duration<double>(Clock::now() - since).count();
+}
+
+//    The game's routine: one lamp write and one input read per sample.
+static sim::Transfer LampWrite, InputRead;
+
+static void queueGameTraffic(unsigned long i)    {
+    static uchar lamps[8] = { 0x3C, 0x04, 0xBC, 0x07, 0, 0, 0, 0 };
+    if(i & 1)    {
+        sim::submit(InputRead, 0xC0, 0xAE, 0, 0, 8);
+        return;
+    }
+    lamps[0] = (lamps[0] & 0xFC) | ((i >> 1) & 3);          //    Next muxer position, same lamps
+    lamps[2] = (lamps[2] & 0xFC) | ((i >> 1) & 3);
+    if((i & 0x3FF) == 0)
+        lamps[0] ^= 0x3C;                                   //    Now and then the lamps change too
+    sim::submit(LampWrite, 0x40, 0xAE, 0, 0, 8, lamps);
+}
+
+static void bench(const sim::Board &b, unsigned long iterations)    {
+    sim::attach(b);
+    wire();
+
+    Clock::time_point t = Clock::now();
+    for(unsigned long i = 0; i < iterations; i++)    {
+        if((i & 0xFF) == 0)
+            Pads = Pads * 5 + 1;
+        b.poll();
+    }
+    double poll = seconds(t);
+    uchar discard[16];
+    sim::controlTransfer(0xC0, 0xB0, 0, 0, discard, sizeof(discard));  //    usbPoll() didn't run above, start the windows here
+
+    t = Clock::now();
+    for(unsigned long i = 0; i < iterations; i++)
+        b.loop();
+    double idle = seconds(t);
+
+    sim::stats.spiBytes = 0;
+    t = Clock::now();
+    for(unsigned long i = 0; i < iterations; i++)    {
+        queueGameTraffic(i);
+        b.loop();
+    }
+    double busy = seconds(t);
+
+    printf("%-8s poll %8.1f ns/call   loop idle %10.0f /s   loop with traffic %10.0f /s   spi %6.4f bytes/loop",
+           b.name, poll * 1e9 / iterations, iterations / idle, iterations / busy,
+           (double)sim::stats.spiBytes / iterations);
+
+    uchar stats[16];
+    int len = sim::controlTransfer(0xC0, 0xB0, 0, 0, stats, sizeof(stats));
+    if(len >= 4)
+        printf("   latched %u skipped %u", stats[0] | (stats[1] << 8), stats[2] | (stats[3] << 8));
+    if(len >= 12)
+        printf("   scans %u overruns %u interval %u-%u us", stats[4] | (stats[5] << 8), stats[6] | (stats[7] << 8),
+               (stats[8] | (stats[9] << 8)) * 4, (stats[10] | (stats[11] << 8)) * 4);
+    if(len >= 14)
+        printf("   poll gap %u us", (stats[12] | (stats[13] << 8)) * 4);
+    printf("\n");
+}
+
+int main(int argc, char **argv)    {
+    unsigned long iterations = argc > 1 ? strtoul(argv[1], 0, 0) : 2000000;
+    for(unsigned i = 0; i < sizeof(Boards) / sizeof(Boards[0]); i++)
+        bench(Boards[i], iterations);
+    return 0;
+}
@@ -0,0 +1,190 @@
+/***********************************************************/
+/*    Poller jitter bench                                  */
+/***********************************************************/
+/*    Plays a game at 60Hz against a MockTransport that    */
+/*    takes as long as the bus per transfer, and taps a    */
+/*    panel for a few ms every so often. It compares the   */
+/*    game polling the board itself with the Poller thread */
+/*    in its modes, and prints the time between poller     */
+/*    cycles, how long the game waits for its inputs each  */
+/*    frame, how old they are and how many taps it saw.    */
+/*                                                         */
+/*    Build from the repository root:                      */
+/*      g++ -O2 -std=c++11 -Ihost/lib \                    */
+/*          host/lib/piuio.cpp host/lib/piuio_mock.cpp \   */
+/*          host/lib/piuio_poller.cpp \                    */
+/*          host/bench/poller_bench.cpp \                  */
+/*          -o poller_bench -lpthread                      */
+/*    Run: ./poller_bench [-t transfer_us] [-s seconds]    */
+/*           [-c cpu] [-p fifo_priority]                   */
+/***********************************************************/
+#include <piuio_poller.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <vector>
+#include <algorithm>
+#include <thread>
+#include <chrono>
+
+#define GAME_FRAME_NS   16666667        //    60Hz render loop
+#define TAP_EVERY_MS    37              //    Not a multiple of the game frame
+#define TAP_MS          5               //    Shorter than a game frame
+
+struct Result    {
+    std::vector<int64_t> intervals;     //    Between poller cycles
+    std::vector<int64_t> blocked;       //    Game waiting for inputs, per frame
+    std::vector<int64_t> ages;          //    Age of the inputs the game got
+    unsigned taps, seen;
+    uint64_t dropped;
+    bool realtime;
+
+    Result() : taps(0), seen(0), dropped(0), realtime(true)    {}
+};
+
+static std::atomic<bool> Tapping;
+static std::atomic<unsigned> Taps;
+
+//    P1 center, all four sensors, for TAP_MS every TAP_EVERY_MS
+static void tapper(piuio::MockTransport *board)    {
+    std::chrono::steady_clock::time_point next = std::chrono::steady_clock::now();
+    while(Tapping)    {
+        next += std::chrono::milliseconds(TAP_EVERY_MS);
+        std::this_thread::sleep_until(next);
+        for(unsigned sensor = 0; sensor < piuio::MUX_POSITIONS; sensor++)
+            board->setPanels(0, sensor, piuio::CENTER);
+        Taps++;
+        std::this_thread::sleep_for(std::chrono::milliseconds(TAP_MS));
+        for(unsigned sensor = 0; sensor < piuio::MUX_POSITIONS; sensor++)
+            board->setPanels(0, sensor, 0);
+    }
+}
+
+//    poller 0 is the game polling by itself
+static Result play(piuio::MockTransport &board, piuio::Poller *poller, double seconds)    {
+    Result result;
+    piuio::Client client(board);
+    piuio::InputState state;
+    bool wasDown = false;
+    int64_t lastStart = 0;
+    Tapping = true;
+    Taps = 0;
+    std::thread tap(tapper, &board);
+    if(poller)
+        poller->start();
+    int64_t start = piuio::Poller::now();
+    int64_t frame = start;
+    while(frame - start < (int64_t)(seconds * 1e9))    {
+        frame += GAME_FRAME_NS;
+        struct timespec ts = { (time_t)(frame / 1000000000), (long)(frame % 1000000000) };
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, 0);
+        int64_t t0 = piuio::Poller::now();
+        bool down;
+        if(!poller)    {
+            client.poll(state);
+            int64_t t1 = piuio::Poller::now();
+            result.ages.push_back(t1 - t0);                     //    Sampled while we waited
+            result.blocked.push_back(t1 - t0);
+            down = state.merged(0) & piuio::CENTER;
+        } else    {
+            piuio::TimedInput input;
+            down = false;
+            int64_t newest = -1;
+            while(poller->pop(input))    {                      //    Every cycle since the last frame
+                if(lastStart)
+                    result.intervals.push_back(input.startNs - lastStart);
+                lastStart = input.startNs;
+                down |= input.state.merged(0) & piuio::CENTER;
+                newest = input.startNs;
+            }
+            int64_t t1 = piuio::Poller::now();
+            result.blocked.push_back(t1 - t0);
+            if(newest >= 0)
+                result.ages.push_back(t1 - newest);
+        }
+        if(down && !wasDown)
+            result.seen++;
+        wasDown = down;
+    }
+    if(poller)    {
+        poller->stop();
+        result.dropped = poller->dropped();
+        result.realtime = poller->realtime();
+    }
+    Tapping = false;
+    tap.join();
+    result.taps = Taps;
+    return result;
+}
+
+static void printUs(std::vector<int64_t> v)    {
+    if(v.empty())    {
+        printf("%8s %8s %8s %8s", "-", "-", "-", "-");
+        return;
+    }
+    std::sort(v.begin(), v.end());
+    double sum = 0, squares = 0;
+    for(size_t i = 0; i < v.size(); i++)
+        sum += v[i];
+    double mean = sum / v.size();
+    for(size_t i = 0; i < v.size(); i++)
+        squares += (v[i] - mean) * (v[i] - mean);
+    printf("%8.0f %8.0f %8.0f %8.0f", mean / 1000, sqrt(squares / v.size()) / 1000,
+           v[v.size() * 99 / 100] / 1000.0, v.back() / 1000.0);
+}
+
+static void print(const char *name, const Result &r)    {
+    printf("%-22s ", name);
+    printUs(r.intervals);
+    printf("  ");
+    printUs(r.blocked);
+    double age = 0;
+    for(size_t i = 0; i < r.ages.size(); i++)
+        age += r.ages[i];
+    printf("  %8.0f  %4u/%-4u %s\n", r.ages.empty() ? 0 : age / r.ages.size() / 1000, r.seen, r.taps,
+           r.dropped ? "(dropped cycles)" : r.realtime ? "" : "(no realtime rights)");
+}
+
+int main(int argc, char **argv)    {
+    unsigned transferUs = 1000;
+    double seconds = 5;
+    piuio::PollerOptions rt;
+    rt.cpu = 0;
+    rt.priority = 50;
+    for(int i = 1; i + 1 < argc; i += 2)    {
+        if(!strcmp(argv[i], "-t"))
+            transferUs = atoi(argv[i + 1]);
+        else if(!strcmp(argv[i], "-s"))
+            seconds = atof(argv[i + 1]);
+        else if(!strcmp(argv[i], "-c"))
+            rt.cpu = atoi(argv[i + 1]);
+        else if(!strcmp(argv[i], "-p"))
+            rt.priority = atoi(argv[i + 1]);
+    }
+
+    piuio::MockTransport board;
+    board.setTransferTime(transferUs);
+    printf("%u us per transfer, %.1fs per mode, game at 60Hz, %dms taps every %dms\n",
+           transferUs, seconds, TAP_MS, TAP_EVERY_MS);
+    printf("%-22s %35s  %35s  %8s  %s\n", "", "poller interval (us)", "game wait per frame (us)", "age (us)", "taps");
+    printf("%-22s %8s %8s %8s %8s  %8s %8s %8s %8s\n", "", "avg", "sd", "p99", "max", "avg", "sd", "p99", "max");
+
+    print("game polls itself", play(board, 0, seconds));
+
+    piuio::PollerOptions sleep;
+    sleep.periodUs = 1000;
+    piuio::Poller sleeping(board, sleep);
+    print("poller, 1ms period", play(board, &sleeping, seconds));
+
+    piuio::PollerOptions busy;
+    busy.periodUs = 0;
+    piuio::Poller spinning(board, busy);
+    print("poller, back to back", play(board, &spinning, seconds));
+
+    rt.periodUs = 0;
+    piuio::Poller realtime(board, rt);
+    print("poller, pinned + FIFO", play(board, &realtime, seconds));
+    return 0;
+}
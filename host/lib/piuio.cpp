@@ -0,0 +1,69 @@
+/***********************************************************/
+/*    PIUIO host library: the muxer cycle                  */
+/***********************************************************/
+/*                    License is GPLv3                     */
+/*  Please consult https://github.com/racerxdl/piuio_clone */
+/***********************************************************/
+#include "piuio.h"
+
+namespace piuio    {
+
+const char *errorName(int error)    {
+    switch(error)    {
+        case OK:                    return "ok";
+        case ERROR_IO:              return "I/O error";
+        case ERROR_TIMEOUT:         return "timeout";
+        case ERROR_NO_DEVICE:       return "no device";
+        case ERROR_NOT_SUPPORTED:   return "not supported";
+        case ERROR_BUSY:            return "busy";
+    }
+    return "unknown error";
+}
+
+int decodeHistory(const uint8_t *reply, int length, HistoryFrame *frames, unsigned max)    {
+    if(length < 4 || length % 4)
+        return ERROR_IO;
+    uint16_t scan = (reply[0] | reply[1] << 8) - 1;            //    The one before the first frame
+    unsigned count = 0;
+    for(int i = 4; i < length && count < max; i += 4, count++)    {
+        scan += (uint8_t)(reply[i] - scan - 1) + 1;             //    Always forward, gaps are lost scans
+        frames[count].scan = scan;
+        frames[count].stamp = reply[i + 1];
+        frames[count].bytes[0] = reply[i + 2];
+        frames[count].bytes[1] = reply[i + 3];
+    }
+    return count;
+}
+
+Client::Client(Transport &transport, bool combined) : transport(transport), useCombined(combined)    {
+}
+
+int Client::step(unsigned position, InputFrame &input)    {
+    lampCache.setMux(position);
+    if(useCombined)    {
+        int r = transport.exchange(lampCache, input);
+        if(r != ERROR_NOT_SUPPORTED)
+            return r;
+        useCombined = false;                                    //    An original board, or an old clone
+    }
+    int r = transport.writeLamps(lampCache);
+    if(r < 0)
+        return r;
+    return transport.readInputs(input);
+}
+
+int Client::poll(InputState &state)    {
+    InputFrame input;
+    for(unsigned position = 0; position < MUX_POSITIONS; position++)    {
+        int r = step(position, input);
+        if(r < 0)
+            return r;
+        for(unsigned player = 0; player < PLAYERS; player++)
+            state.panels[player][position] = input.panels(player);
+    }
+    for(unsigned player = 0; player < PLAYERS; player++)
+        state.buttons[player] = input.buttons(player);
+    return OK;
+}
+
+}
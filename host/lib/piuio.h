@@ -0,0 +1,323 @@
+/***********************************************************/
+/*    PIUIO host library                                   */
+/***********************************************************/
+/*    Talks to a PIUIO (or any of the clones) from a PC.   */
+/*    The frames are the 8 byte lamp and input buffers of  */
+/*    docs/piuio.txt with accessors for the bits, and the  */
+/*    Client runs the 4 position muxer cycle the game      */
+/*    does. Nothing here allocates once a transport is     */
+/*    open, so it can sit in a tight polling loop.         */
+/*                                                         */
+/*    The Transport does the actual transfers:             */
+/*      UsbTransport   libusb, piuio_usb.cpp               */
+/*      MockTransport  a board in memory, piuio_mock.cpp   */
+/*    and a CoalescingTransport (piuio_coalesce.cpp) can   */
+/*    go in front of either to drop the lamp writes that   */
+/*    change nothing on the board.                         */
+/*    Errors are returned as the negative values of Error, */
+/*    0 is success.                                        */
+/***********************************************************/
+/*                    License is GPLv3                     */
+/*  Please consult https://github.com/racerxdl/piuio_clone */
+/***********************************************************/
+#ifndef PIUIO_HOST_H
+#define PIUIO_HOST_H
+
+#include <stdint.h>
+#include <string.h>
+#include <atomic>
+
+struct libusb_context;
+struct libusb_device_handle;
+
+namespace piuio    {
+
+enum    {
+    VID                 = 0x0547,   //    As in usbconfig.h of the sketches
+    PID                 = 0x1002,
+    REQUEST             = 0xAE,     //    Lamp write (0x40) and input read (0xC0)
+    EDGE_REQUEST        = 0xAF,     //    Clone extensions, see docs/piuio.txt
+    STATS_REQUEST       = 0xB0,
+    COMBINED_REQUEST    = 0xB1,
+    HISTORY_REQUEST     = 0xB2,
+    SETTLE_REQUEST      = 0xB3,
+    HISTORY_FRAMES      = 62,       //    As many as one transfer takes without USB_CFG_LONG_TRANSFERS
+    MUX_POSITIONS       = 4,
+    PLAYERS             = 2
+};
+
+enum Error    {
+    OK                  = 0,
+    ERROR_IO            = -1,
+    ERROR_TIMEOUT       = -2,
+    ERROR_NO_DEVICE     = -3,
+    ERROR_NOT_SUPPORTED = -4,       //    The board stalled a request it doesn't know
+    ERROR_BUSY          = -5        //    Someone else has it
+};
+
+const char *errorName(int error);
+
+//    Panels of a pad, the same bits for the sensors and the lamps
+enum    {
+    UP_LEFT     = 0x01,
+    UP_RIGHT    = 0x02,
+    CENTER      = 0x04,
+    DOWN_LEFT   = 0x08,
+    DOWN_RIGHT  = 0x10,
+    ALL_PANELS  = 0x1F
+};
+
+//    Buttons in the second byte of each player in the input report
+enum    {
+    BUTTON_TEST     = 0x02,
+    BUTTON_COIN     = 0x04,
+    BUTTON_SERVICE  = 0x40,
+    BUTTON_CLEAR    = 0x80,
+    ALL_BUTTONS     = 0xC6
+};
+
+//    What the game writes with 0x40. Bytes 4-7 are not used.
+struct LampFrame    {
+    uint8_t bytes[8];
+
+    LampFrame()                                     { memset(bytes, 0, sizeof(bytes)); }
+
+    //    ZZ, the sensor the next input read returns, for both players
+    unsigned mux() const                            { return bytes[0] & 0x03; }
+    void setMux(unsigned position)    {
+        bytes[0] = (bytes[0] & 0xFC) | (position & 0x03);
+        bytes[2] = (bytes[2] & 0xFC) | (position & 0x03);
+    }
+
+    uint8_t panels(unsigned player) const           { return (bytes[player * 2] >> 2) & ALL_PANELS; }
+    void setPanels(unsigned player, uint8_t panels)    {
+        bytes[player * 2] = (bytes[player * 2] & 0x83) | ((panels & ALL_PANELS) << 2);
+    }
+
+    bool neon() const                               { return bytes[1] & 0x04; }
+    void setNeon(bool on)                           { bytes[1] = on ? bytes[1] | 0x04 : bytes[1] & ~0x04; }
+
+    //    The four halo lamps in the order the clones latch them:
+    //    bits 0-2 are BYTE3 bits 0-2, bit 3 is BYTE2 bit 7
+    uint8_t halo() const                            { return (bytes[3] & 0x07) | ((bytes[2] & 0x80) >> 4); }
+    void setHalo(uint8_t halo)    {
+        bytes[3] = (bytes[3] & 0xF8) | (halo & 0x07);
+        bytes[2] = (bytes[2] & 0x7F) | ((halo & 0x08) << 4);
+    }
+
+    //    How the combined request (0xB1) carries it in the setup packet
+    uint16_t value() const                          { return bytes[0] | (bytes[1] << 8); }
+    uint16_t index() const                          { return bytes[2] | (bytes[3] << 8); }
+};
+
+//    What the board answers to 0xC0. The bits are active low on the wire,
+//    the accessors return 1 for pressed.
+struct InputFrame    {
+    uint8_t bytes[8];
+
+    InputFrame()                                    { memset(bytes, 0xFF, sizeof(bytes)); }
+
+    uint8_t panels(unsigned player) const           { return ~bytes[player * 2] & ALL_PANELS; }
+    uint8_t buttons(unsigned player) const          { return ~bytes[player * 2 + 1] & ALL_BUTTONS; }
+
+    //    Clones built with REPORT_META only, see docs/piuio.txt
+    uint16_t scan() const                           { return bytes[4] | bytes[5] << 8; }
+    uint8_t lampAck() const                         { return bytes[6]; }
+    unsigned ageUs() const                          { return bytes[7] * 64; }
+};
+
+//    One whole muxer cycle: every sensor of every panel
+struct InputState    {
+    uint8_t panels[PLAYERS][MUX_POSITIONS];        //    Pressed panels seen by each sensor
+    uint8_t buttons[PLAYERS];                       //    From the last read of the cycle
+
+    InputState()    {
+        memset(panels, 0, sizeof(panels));
+        memset(buttons, 0, sizeof(buttons));
+    }
+
+    //    A panel is down when any of its sensors is
+    uint8_t merged(unsigned player) const    {
+        return panels[player][0] | panels[player][1] | panels[player][2] | panels[player][3];
+    }
+};
+
+//    One scan out of the history of the clone (0xB2): the sensor bytes of
+//    the report as that scan read them. With AUTO_MUX it's the muxer
+//    position scan & 3 only.
+struct HistoryFrame    {
+    uint16_t scan;
+    uint8_t stamp;                                  //    Timer1 >> 8 at the scan, about 1ms per count
+    uint8_t bytes[2];                               //    Input BYTE0 and BYTE2, active low
+
+    uint8_t panels(unsigned player) const           { return ~bytes[player] & ALL_PANELS; }
+};
+
+//    Unpacks a history reply, rebuilding the scan numbers from the low
+//    bytes on the wire. The number of frames, or ERROR_IO.
+int decodeHistory(const uint8_t *reply, int length, HistoryFrame *frames, unsigned max);
+
+class Transport    {
+public:
+    virtual ~Transport()    {}
+    virtual int writeLamps(const LampFrame &lamps) = 0;
+    virtual int readInputs(InputFrame &input) = 0;
+    //    Both in one transfer (0xB1). Boards without it give ERROR_NOT_SUPPORTED.
+    virtual int exchange(const LampFrame &, InputFrame &)    { return ERROR_NOT_SUPPORTED; }
+    //    The scans from number first on that the board still has, up to
+    //    max (at most HISTORY_FRAMES). The number of frames read; a gap
+    //    in the scan numbers means scans were lost. Boards without
+    //    INPUT_HISTORY give ERROR_NOT_SUPPORTED.
+    virtual int readHistory(uint16_t, HistoryFrame *, unsigned)    { return ERROR_NOT_SUPPORTED; }
+};
+
+//    A board on USB. Control transfers on endpoint 0 only, so nothing has to
+//    be claimed and the kernel driver, if any, can stay.
+class UsbTransport : public Transport    {
+public:
+    UsbTransport();
+    ~UsbTransport();
+
+    //    Opens the index-th board with our VID/PID
+    int open(unsigned index = 0);
+    void close();
+    bool isOpen() const                             { return dev != 0; }
+    void setTimeout(unsigned ms)                    { timeout = ms; }
+
+    int writeLamps(const LampFrame &lamps);
+    int readInputs(InputFrame &input);
+    int exchange(const LampFrame &lamps, InputFrame &input);
+    int readHistory(uint16_t first, HistoryFrame *frames, unsigned max);
+
+private:
+    libusb_context *ctx;
+    libusb_device_handle *dev;
+    unsigned timeout;
+
+    UsbTransport(const UsbTransport &);
+    UsbTransport &operator=(const UsbTransport &);
+};
+
+//    A clone in memory, answering like the sketches with AUTO_MUX: a read
+//    returns the sensors the ZZ of the last lamp write selected, or with
+//    setMerged() every sensor of a panel merged, like AUTO_MUX_MERGE.
+//    Tests set the pads, run the code under test and look at the lamps and
+//    counters. failNext() makes the next transfers fail. The pads can be
+//    set from another thread than the one doing the transfers, and
+//    setTransferTime() makes every transfer take as long as on the bus.
+class MockTransport : public Transport    {
+public:
+    explicit MockTransport(bool combined = true);
+
+    void setPanels(unsigned player, unsigned sensor, uint8_t panels);
+    void setButtons(unsigned player, uint8_t buttons);
+    void failNext(unsigned transfers, int error = ERROR_IO);
+    void setTransferTime(unsigned us)               { transferUs = us; }
+    void setMerged(bool merged)                     { mergedReport = merged; }
+
+    const LampFrame &lamps() const                  { return lampFrame; }
+    unsigned writes() const                         { return lampWrites; }
+    unsigned reads() const                          { return inputReads; }
+    unsigned exchanges() const                      { return combinedReads; }
+
+    int writeLamps(const LampFrame &lamps);
+    int readInputs(InputFrame &input);
+    int exchange(const LampFrame &lamps, InputFrame &input);
+
+private:
+    bool combined;
+    std::atomic<uint8_t> pads[PLAYERS][MUX_POSITIONS];
+    std::atomic<uint8_t> buttonState[PLAYERS];
+    LampFrame lampFrame;
+    unsigned lampWrites, inputReads, combinedReads;
+    unsigned failures;
+    int failure;
+    unsigned transferUs;
+    bool mergedReport;
+
+    int transfer();                                 //    Bus time and failNext(), for every transfer
+    void report(InputFrame &input) const;
+};
+
+//    Decides which lamp frames have to reach the board. A frame with the
+//    same lamps and ZZ as the last one that went out changes nothing and
+//    is dropped. One that only changes lamps within the window of the last
+//    one that went out is held back, the newest wins, and goes out once
+//    the window is over. A new ZZ always goes out at once, the next read
+//    depends on it, unless ignoreMux says the board doesn't care about ZZ
+//    (AUTO_MUX_MERGE). Times are ns of any monotonic clock.
+class LampFilter    {
+public:
+    explicit LampFilter(unsigned windowUs = 0, bool ignoreMux = false);
+
+    void setWindow(unsigned us)                     { windowNs = us * 1000LL; }
+    void setIgnoreMux(bool ignore)                  { ignoreMux = ignore; }
+
+    //    False when the frame can stay home, it's then counted
+    bool needed(const LampFrame &lamps, int64_t now);
+    //    The held back frame, once its window is over
+    bool due(int64_t now) const                     { return holding && now - lastNs >= windowNs; }
+    bool held() const                               { return holding; }
+    const LampFrame &heldFrame() const              { return heldLamps; }
+    //    After a transfer that carried lamps went through, or failed
+    void sent(const LampFrame &lamps, int64_t now);
+    void forget()                                   { known = false; }
+
+    uint64_t writes() const                         { return sentCount; }
+    uint64_t duplicates() const                     { return duplicateCount; }
+    uint64_t coalesced() const                      { return coalescedCount; }
+    uint64_t suppressed() const                     { return duplicateCount + coalescedCount; }
+
+private:
+    LampFrame last, heldLamps;
+    bool known, holding, ignoreMux;
+    int64_t lastNs, windowNs;
+    uint64_t sentCount, duplicateCount, coalescedCount;
+
+    bool same(const LampFrame &a, const LampFrame &b) const;
+};
+
+//    Another transport with a LampFilter on its lamp writes. The held back
+//    frame goes out with the first transfer after its window, or flush().
+class CoalescingTransport : public Transport    {
+public:
+    explicit CoalescingTransport(Transport &transport, unsigned windowUs = 0, bool ignoreMux = false);
+
+    LampFilter &filter()                            { return lampFilter; }
+    //    Sends the held back frame now, if any
+    int flush();
+
+    int writeLamps(const LampFrame &lamps);
+    int readInputs(InputFrame &input);
+    int exchange(const LampFrame &lamps, InputFrame &input);
+
+private:
+    Transport &transport;
+    LampFilter lampFilter;
+
+    int send(const LampFrame &lamps, int64_t now);
+};
+
+//    Runs the muxer cycle on a transport. The lamps set with lamps() are
+//    sent with every step; ZZ in them is overwritten.
+class Client    {
+public:
+    explicit Client(Transport &transport, bool combined = true);
+
+    LampFrame &lamps()                              { return lampCache; }
+    bool combined() const                           { return useCombined; }
+
+    //    One muxer position: lamps with ZZ = position, then the inputs
+    int step(unsigned position, InputFrame &input);
+    //    All four positions into state
+    int poll(InputState &state);
+
+private:
+    Transport &transport;
+    LampFrame lampCache;
+    bool useCombined;
+};
+
+}
+
+#endif
@@ -0,0 +1,96 @@
+/***********************************************************/
+/*    PIUIO host library: lamp write coalescing            */
+/***********************************************************/
+/*                    License is GPLv3                     */
+/*  Please consult https://github.com/racerxdl/piuio_clone */
+/***********************************************************/
+#include "piuio.h"
+
+#include <chrono>
+
+namespace piuio    {
+
+static int64_t now()    {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+LampFilter::LampFilter(unsigned windowUs, bool ignoreMux) : known(false), holding(false), ignoreMux(ignoreMux),
+        lastNs(0), windowNs(windowUs * 1000LL), sentCount(0), duplicateCount(0), coalescedCount(0)    {
+}
+
+//    Bytes 0-3 only, the board doesn't use the rest
+bool LampFilter::same(const LampFrame &a, const LampFrame &b) const    {
+    uint8_t mask = ignoreMux ? 0xFC : 0xFF;
+    return !((a.bytes[0] ^ b.bytes[0]) & mask) && a.bytes[1] == b.bytes[1] &&
+           !((a.bytes[2] ^ b.bytes[2]) & mask) && a.bytes[3] == b.bytes[3];
+}
+
+bool LampFilter::needed(const LampFrame &lamps, int64_t now)    {
+    if(known && same(lamps, last))    {
+        holding = false;                                        //    Back to what the board has
+        duplicateCount++;
+        return false;
+    }
+    bool muxChanged = !known || (!ignoreMux && ((lamps.bytes[0] ^ last.bytes[0]) & 0x03 ||
+                                                (lamps.bytes[2] ^ last.bytes[2]) & 0x03));
+    if(!muxChanged && now - lastNs < windowNs)    {
+        heldLamps = lamps;
+        holding = true;
+        coalescedCount++;
+        return false;
+    }
+    return true;
+}
+
+void LampFilter::sent(const LampFrame &lamps, int64_t now)    {
+    last = lamps;
+    known = true;
+    holding = false;
+    lastNs = now;
+    sentCount++;
+}
+
+CoalescingTransport::CoalescingTransport(Transport &transport, unsigned windowUs, bool ignoreMux) :
+        transport(transport), lampFilter(windowUs, ignoreMux)    {
+}
+
+int CoalescingTransport::send(const LampFrame &lamps, int64_t now)    {
+    int r = transport.writeLamps(lamps);
+    if(r < 0)
+        lampFilter.forget();                                    //    Who knows what the board has now
+    else
+        lampFilter.sent(lamps, now);
+    return r;
+}
+
+int CoalescingTransport::flush()    {
+    if(!lampFilter.held())
+        return OK;
+    return send(lampFilter.heldFrame(), now());
+}
+
+int CoalescingTransport::writeLamps(const LampFrame &lamps)    {
+    int64_t t = now();
+    if(!lampFilter.needed(lamps, t))
+        return OK;
+    return send(lamps, t);
+}
+
+int CoalescingTransport::readInputs(InputFrame &input)    {
+    int64_t t = now();
+    if(lampFilter.due(t))
+        send(lampFilter.heldFrame(), t);                        //    Same ZZ, the read doesn't care if it fails
+    return transport.readInputs(input);
+}
+
+int CoalescingTransport::exchange(const LampFrame &lamps, InputFrame &input)    {
+    int r = transport.exchange(lamps, input);
+    if(r == OK)
+        lampFilter.sent(lamps, now());                          //    Supersedes anything held back
+    else if(r != ERROR_NOT_SUPPORTED)
+        lampFilter.forget();
+    return r;
+}
+
+}
@@ -0,0 +1,276 @@
+/***********************************************************/
+/*    PIUIO host library: many boards, one event loop      */
+/***********************************************************/
+/*                    License is GPLv3                     */
+/*  Please consult https://github.com/racerxdl/piuio_clone */
+/***********************************************************/
+#include "piuio_manager.h"
+#include "piuio_poller.h"
+
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#define MAX_EVENTS  16
+
+namespace piuio    {
+
+Manager::Manager(Bus &bus, bool combined) : bus(bus), combined(combined), lampWindowUs(0), lampIgnoreMux(false),
+        epollFd(-1)    {
+}
+
+void Manager::setLampFilter(unsigned windowUs, bool ignoreMux)    {
+    lampWindowUs = windowUs;
+    lampIgnoreMux = ignoreMux;
+}
+
+Manager::~Manager()    {
+    close();
+}
+
+int Manager::open()    {
+    close();
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if(epollFd < 0)
+        return ERROR_IO;
+    int r = bus.attach(*this);
+    if(r < 0)    {
+        close();
+        return r;
+    }
+    int64_t now = Poller::now();
+    for(unsigned device = 0; device < boards.size(); device++)    {
+        boards[device].stats.startNs = now;
+        submit(device, combined ? Transfer::EXCHANGE : Transfer::WRITE);
+    }
+    return boards.size();
+}
+
+void Manager::close()    {
+    if(epollFd < 0)
+        return;
+    bus.detach();                                               //    Still unwatches its fds
+    ::close(epollFd);
+    epollFd = -1;
+    boards.clear();
+}
+
+int Manager::run(int timeoutMs)    {
+    if(epollFd < 0)
+        return ERROR_NO_DEVICE;
+    int busTimeout = bus.timeoutMs();
+    if(busTimeout >= 0 && (timeoutMs < 0 || busTimeout < timeoutMs))
+        timeoutMs = busTimeout;
+    struct epoll_event events[MAX_EVENTS];
+    int n = epoll_wait(epollFd, events, MAX_EVENTS, timeoutMs);
+    if(n < 0)
+        return errno == EINTR ? OK : ERROR_IO;
+    if(!n)
+        bus.ready(-1);
+    for(int i = 0; i < n; i++)
+        bus.ready(events[i].data.fd);
+    for(unsigned device = 0; device < boards.size(); device++)
+        if(boards[device].stalled)    {                         //    The bus refused it last time
+            boards[device].stalled = false;
+            submit(device, boards[device].transfer.kind);
+        }
+    return OK;
+}
+
+bool Manager::input(unsigned device, InputState &state) const    {
+    if(!boards[device].valid)
+        return false;
+    state = boards[device].state;
+    return true;
+}
+
+unsigned Manager::addDevice()    {
+    Board board;
+    board.valid = false;
+    board.combined = combined;
+    board.gone = false;
+    board.stalled = false;
+    board.position = 0;
+    board.submitNs = 0;
+    board.cycleNs = 0;
+    board.filter = LampFilter(lampWindowUs, lampIgnoreMux);
+    boards.push_back(board);
+    return boards.size() - 1;
+}
+
+int Manager::watch(int fd, bool out)    {
+    struct epoll_event event;
+    event.events = out ? EPOLLOUT : EPOLLIN;
+    event.data.u64 = 0;
+    event.data.fd = fd;
+    return epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) < 0 ? ERROR_IO : OK;
+}
+
+void Manager::unwatch(int fd)    {
+    struct epoll_event event;                                   //    Kernels before 2.6.9 want one
+    memset(&event, 0, sizeof(event));
+    epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, &event);
+}
+
+void Manager::submit(unsigned device, Transfer::Kind kind)    {
+    Board &board = boards[device];
+    board.transfer.kind = kind;
+    if(kind != Transfer::READ)    {
+        board.transfer.lamps = board.lamps;
+        board.transfer.lamps.setMux(board.position);
+    }
+    board.submitNs = Poller::now();
+    if(!board.position && kind != Transfer::READ)
+        board.cycleNs = board.submitNs;
+    if(kind == Transfer::WRITE && !board.filter.needed(board.transfer.lamps, board.submitNs))
+        board.transfer.kind = Transfer::READ;                   //    The board has these lamps already
+    int r = bus.submit(device, board.transfer);
+    if(r < 0)    {
+        board.stats.errors++;
+        if(r == ERROR_NO_DEVICE)
+            board.gone = true;
+        else
+            board.stalled = true;
+    }
+}
+
+void Manager::failed(unsigned device, int error)    {
+    Board &board = boards[device];
+    board.stats.errors++;
+    if(error == ERROR_NO_DEVICE)    {
+        board.gone = true;
+        return;
+    }
+    board.position = 0;                                         //    Throw the cycle away, like Client::poll()
+    submit(device, board.combined ? Transfer::EXCHANGE : Transfer::WRITE);
+}
+
+void Manager::completed(unsigned device)    {
+    Board &board = boards[device];
+    int64_t now = Poller::now();
+    int64_t took = now - board.submitNs;
+    board.stats.transfers++;
+    board.stats.transferNs += took;
+    if(took > board.stats.transferMaxNs)
+        board.stats.transferMaxNs = took;
+
+    int r = board.transfer.result;
+    if(board.transfer.kind != Transfer::READ)    {
+        if(r == OK)
+            board.filter.sent(board.transfer.lamps, board.submitNs);
+        else if(r != ERROR_NOT_SUPPORTED)
+            board.filter.forget();
+    }
+    if(r == ERROR_NOT_SUPPORTED && board.transfer.kind == Transfer::EXCHANGE)    {
+        board.combined = false;                                 //    An original board, or an old clone
+        submit(device, Transfer::WRITE);
+        return;
+    }
+    if(r < 0)    {
+        failed(device, r);
+        return;
+    }
+    if(board.transfer.kind == Transfer::WRITE)    {
+        submit(device, Transfer::READ);
+        return;
+    }
+
+    for(unsigned player = 0; player < PLAYERS; player++)
+        board.fresh.panels[player][board.position] = board.transfer.input.panels(player);
+    if(++board.position == MUX_POSITIONS)    {
+        for(unsigned player = 0; player < PLAYERS; player++)
+            board.fresh.buttons[player] = board.transfer.input.buttons(player);
+        board.state = board.fresh;
+        board.valid = true;
+        board.position = 0;
+        board.stats.cycles++;
+        board.stats.cycleNs += now - board.cycleNs;
+        if(now - board.cycleNs > board.stats.cycleMaxNs)
+            board.stats.cycleMaxNs = now - board.cycleNs;
+    }
+    submit(device, board.combined ? Transfer::EXCHANGE : Transfer::WRITE);
+}
+
+SimBus::SimBus(unsigned devices, unsigned transferUs, bool combined) : manager(0)    {
+    for(unsigned device = 0; device < devices; device++)    {
+        Board board;
+        board.mock = new MockTransport(combined);
+        board.timer = -1;
+        board.transferUs = transferUs;
+        board.pending = 0;
+        boards.push_back(board);
+    }
+}
+
+SimBus::~SimBus()    {
+    detach();
+    for(unsigned device = 0; device < boards.size(); device++)
+        delete boards[device].mock;
+}
+
+int SimBus::attach(Manager &manager)    {
+    detach();
+    this->manager = &manager;
+    for(unsigned device = 0; device < boards.size(); device++)    {
+        boards[device].timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if(boards[device].timer < 0 || manager.watch(boards[device].timer) < 0)    {
+            detach();
+            return ERROR_IO;
+        }
+        manager.addDevice();
+    }
+    return OK;
+}
+
+void SimBus::detach()    {
+    for(unsigned device = 0; device < boards.size(); device++)    {
+        Board &board = boards[device];
+        if(board.timer < 0)
+            continue;
+        if(manager)
+            manager->unwatch(board.timer);
+        close(board.timer);
+        board.timer = -1;
+        board.pending = 0;
+    }
+    manager = 0;
+}
+
+int SimBus::submit(unsigned device, Transfer &transfer)    {
+    Board &board = boards[device];
+    if(board.timer < 0)
+        return ERROR_NO_DEVICE;
+    struct itimerspec when;
+    memset(&when, 0, sizeof(when));
+    when.it_value.tv_sec = board.transferUs / 1000000;
+    when.it_value.tv_nsec = board.transferUs % 1000000 * 1000;
+    if(!board.transferUs)
+        when.it_value.tv_nsec = 1;                              //    0 would disarm it
+    if(timerfd_settime(board.timer, 0, &when, 0) < 0)
+        return ERROR_IO;
+    board.pending = &transfer;
+    return OK;
+}
+
+void SimBus::ready(int fd)    {
+    for(unsigned device = 0; device < boards.size(); device++)    {
+        Board &board = boards[device];
+        if(board.timer != fd)
+            continue;
+        uint64_t expirations;
+        if(read(fd, &expirations, sizeof(expirations)) != sizeof(expirations) || !board.pending)
+            return;
+        Transfer &transfer = *board.pending;
+        board.pending = 0;
+        switch(transfer.kind)    {
+            case Transfer::WRITE:       transfer.result = board.mock->writeLamps(transfer.lamps);  break;
+            case Transfer::READ:        transfer.result = board.mock->readInputs(transfer.input);  break;
+            case Transfer::EXCHANGE:    transfer.result = board.mock->exchange(transfer.lamps, transfer.input);  break;
+        }
+        manager->completed(device);
+        return;
+    }
+}
+
+}
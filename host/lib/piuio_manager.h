@@ -0,0 +1,189 @@
+/***********************************************************/
+/*    PIUIO host library: many boards, one event loop      */
+/***********************************************************/
+/*    Runs the muxer cycle of every board it finds with    */
+/*    asynchronous transfers, all from one epoll loop on   */
+/*    one thread, instead of a thread per board blocking   */
+/*    in libusb. Each board has one transfer in flight at  */
+/*    a time (it's all endpoint 0), so the boards run side */
+/*    by side, each as fast as its own bus allows.         */
+/*                                                         */
+/*    The Bus does the transfers:                          */
+/*      UsbBus  every board with our VID/PID, async libusb */
+/*      SimBus  MockTransports behind timers, in process   */
+/*    The manager counts transfers, cycles, errors and how */
+/*    long they take for each board.                       */
+/*                                                         */
+/*    Nothing here is thread safe: setLamps(), input() and */
+/*    run() all belong to the thread that runs the loop.   */
+/***********************************************************/
+/*                    License is GPLv3                     */
+/*  Please consult https://github.com/racerxdl/piuio_clone */
+/***********************************************************/
+#ifndef PIUIO_MANAGER_H
+#define PIUIO_MANAGER_H
+
+#include "piuio.h"
+
+#include <vector>
+
+namespace piuio    {
+
+class Manager;
+
+//    One control transfer of the muxer cycle
+struct Transfer    {
+    enum Kind    {
+        WRITE,                                      //    0x40, lamps
+        READ,                                       //    0xC0, into input
+        EXCHANGE                                    //    0xB1, lamps in the setup packet, into input
+    };
+    Kind kind;
+    LampFrame lamps;
+    InputFrame input;
+    int result;                                     //    Set by the bus when it's done
+};
+
+//    Where the transfers go. attach() adds the boards with addDevice() and
+//    the fds to wait on with watch(). The bus finishes its transfers from
+//    ready() and hands each one back with Manager::completed().
+class Bus    {
+public:
+    virtual ~Bus()    {}
+    virtual int attach(Manager &manager) = 0;
+    virtual void detach() = 0;
+    //    Never more than one per device at a time
+    virtual int submit(unsigned device, Transfer &transfer) = 0;
+    //    fd is ready, or -1 when the wait timed out
+    virtual void ready(int fd) = 0;
+    //    How long the loop may wait for the fds at most, -1 for as long as it likes
+    virtual int timeoutMs()                         { return -1; }
+};
+
+struct DeviceStats    {
+    uint64_t cycles, transfers, errors;
+    int64_t transferNs, transferMaxNs;              //    Sum and worst, submit to completion
+    int64_t cycleNs, cycleMaxNs;                    //    Sum and worst, four positions
+    int64_t startNs;                                //    When the loop started on it
+
+    DeviceStats()    { memset(this, 0, sizeof(*this)); }
+};
+
+class Manager    {
+public:
+    explicit Manager(Bus &bus, bool combined = true);
+    ~Manager();
+
+    //    Attaches the bus and starts every board on it. The number of boards.
+    int open();
+    void close();
+    //    The epoll fd, to wait on from another loop. Readable when run(0) has work.
+    int fd() const                                  { return epollFd; }
+    //    Waits up to timeoutMs for transfers and handles what finished
+    int run(int timeoutMs);
+
+    unsigned devices() const                        { return boards.size(); }
+    bool present(unsigned device) const             { return !boards[device].gone; }
+    //    Sent from the next muxer position on. ZZ in them is overwritten.
+    void setLamps(unsigned device, const LampFrame &lamps)    { boards[device].lamps = lamps; }
+    //    Lamp writes of the boards without the combined request go through
+    //    a LampFilter each, see piuio.h. Call before open().
+    void setLampFilter(unsigned windowUs, bool ignoreMux = false);
+    const LampFilter &lampFilter(unsigned device) const    { return boards[device].filter; }
+    //    The last whole cycle of a board, false before its first one
+    bool input(unsigned device, InputState &state) const;
+    const DeviceStats &stats(unsigned device) const    { return boards[device].stats; }
+
+    //    Bus side
+    unsigned addDevice();
+    int watch(int fd, bool out = false);
+    void unwatch(int fd);
+    void completed(unsigned device);
+
+private:
+    struct Board    {
+        Transfer transfer;
+        LampFrame lamps;
+        InputState fresh, state;
+        bool valid, combined, gone, stalled;
+        unsigned position;
+        int64_t submitNs, cycleNs;
+        DeviceStats stats;
+        LampFilter filter;
+    };
+
+    Bus &bus;
+    bool combined;
+    unsigned lampWindowUs;
+    bool lampIgnoreMux;
+    int epollFd;
+    std::vector<Board> boards;
+
+    void submit(unsigned device, Transfer::Kind kind);
+    void failed(unsigned device, int error);
+
+    Manager(const Manager &);
+    Manager &operator=(const Manager &);
+};
+
+//    Every board with our VID/PID, opened when the manager attaches
+class UsbBus : public Bus    {
+public:
+    UsbBus();
+    ~UsbBus();
+
+    void setTimeout(unsigned ms)                    { timeout = ms; }
+
+    int attach(Manager &manager);
+    void detach();
+    int submit(unsigned device, Transfer &transfer);
+    void ready(int fd);
+    int timeoutMs();
+
+    struct Board;                                   //    libusb stuff, in piuio_usb_async.cpp
+
+private:
+    libusb_context *ctx;
+    Manager *manager;
+    std::vector<Board *> boards;
+    unsigned timeout;
+    unsigned cancelled;                             //    Boards detached with a transfer still in flight
+
+    UsbBus(const UsbBus &);
+    UsbBus &operator=(const UsbBus &);
+};
+
+//    Boards in memory. A transfer completes transferUs after it was
+//    submitted, through a timerfd in the loop like a real one, and is
+//    answered by the MockTransport of its board.
+class SimBus : public Bus    {
+public:
+    explicit SimBus(unsigned devices, unsigned transferUs = 1000, bool combined = true);
+    ~SimBus();
+
+    MockTransport &board(unsigned device)           { return *boards[device].mock; }
+    void setTransferTime(unsigned device, unsigned us)    { boards[device].transferUs = us; }
+
+    int attach(Manager &manager);
+    void detach();
+    int submit(unsigned device, Transfer &transfer);
+    void ready(int fd);
+
+private:
+    struct Board    {
+        MockTransport *mock;
+        int timer;
+        unsigned transferUs;
+        Transfer *pending;
+    };
+
+    Manager *manager;
+    std::vector<Board> boards;
+
+    SimBus(const SimBus &);
+    SimBus &operator=(const SimBus &);
+};
+
+}
+
+#endif
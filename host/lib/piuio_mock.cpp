@@ -0,0 +1,83 @@
+/***********************************************************/
+/*    PIUIO host library: a board in memory                */
+/***********************************************************/
+/*                    License is GPLv3                     */
+/*  Please consult https://github.com/racerxdl/piuio_clone */
+/***********************************************************/
+#include "piuio.h"
+
+#include <chrono>
+#include <thread>
+
+namespace piuio    {
+
+MockTransport::MockTransport(bool combined) : combined(combined), lampWrites(0), inputReads(0),
+        combinedReads(0), failures(0), failure(OK), transferUs(0), mergedReport(false)    {
+    for(unsigned player = 0; player < PLAYERS; player++)    {
+        for(unsigned sensor = 0; sensor < MUX_POSITIONS; sensor++)
+            pads[player][sensor] = 0;
+        buttonState[player] = 0;
+    }
+}
+
+void MockTransport::setPanels(unsigned player, unsigned sensor, uint8_t panels)    {
+    pads[player][sensor] = panels & ALL_PANELS;
+}
+
+void MockTransport::setButtons(unsigned player, uint8_t buttons)    {
+    buttonState[player] = buttons & ALL_BUTTONS;
+}
+
+void MockTransport::failNext(unsigned transfers, int error)    {
+    failures = transfers;
+    failure = error;
+}
+
+int MockTransport::transfer()    {
+    if(transferUs)                                              //    Blocks, like libusb waiting on the bus
+        std::this_thread::sleep_for(std::chrono::microseconds(transferUs));
+    if(!failures)
+        return OK;
+    failures--;
+    return failure;
+}
+
+int MockTransport::writeLamps(const LampFrame &lamps)    {
+    if(int r = transfer())
+        return r;
+    lampFrame = lamps;
+    lampWrites++;
+    return OK;
+}
+
+void MockTransport::report(InputFrame &input) const    {
+    for(unsigned player = 0; player < PLAYERS; player++)    {    //    ZZ of each player picks its sensor
+        if(mergedReport)
+            input.bytes[player * 2] = ~(pads[player][0] | pads[player][1] | pads[player][2] | pads[player][3]);
+        else
+            input.bytes[player * 2] = ~pads[player][lampFrame.bytes[player * 2] & 0x03];
+        input.bytes[player * 2 + 1] = ~buttonState[player];
+    }
+    memset(input.bytes + 4, 0xFF, 4);                           //    Junk, as the board sends it
+}
+
+int MockTransport::readInputs(InputFrame &input)    {
+    if(int r = transfer())
+        return r;
+    report(input);
+    inputReads++;
+    return OK;
+}
+
+int MockTransport::exchange(const LampFrame &lamps, InputFrame &input)    {
+    if(!combined)
+        return ERROR_NOT_SUPPORTED;
+    if(int r = transfer())
+        return r;
+    lampFrame = lamps;
+    report(input);
+    combinedReads++;
+    return OK;
+}
+
+}
@@ -0,0 +1,132 @@
+/***********************************************************/
+/*    PIUIO host library: polling thread                   */
+/***********************************************************/
+/*                    License is GPLv3                     */
+/*  Please consult https://github.com/racerxdl/piuio_clone */
+/***********************************************************/
+#include "piuio_poller.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+namespace piuio    {
+
+int64_t Poller::now()    {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+Poller::Poller(Transport &transport, const PollerOptions &options) : transport(transport), options(options),
+        quit(false), active(false), lampWord(0), realtimeApplied(false), cycleCount(0), errorCount(0), dropCount(0)    {
+}
+
+Poller::~Poller()    {
+    stop();
+}
+
+int Poller::start()    {
+    if(active)
+        return OK;
+    if(thread.joinable())
+        thread.join();                                          //    Stopped by itself, it's done already
+    quit = false;
+    active = true;
+    try    {
+        thread = std::thread(&Poller::run, this);
+    } catch(...)    {
+        active = false;
+        return ERROR_IO;
+    }
+    return OK;
+}
+
+void Poller::stop()    {
+    quit = true;
+    if(thread.joinable())
+        thread.join();
+}
+
+void Poller::setLamps(const LampFrame &lamps)    {
+    lampWord.store(lamps.bytes[0] | lamps.bytes[1] << 8 | lamps.bytes[2] << 16 | (uint32_t)lamps.bytes[3] << 24,
+                   std::memory_order_relaxed);
+}
+
+bool Poller::pop(TimedInput &input)    {
+    return ring.pop(input);
+}
+
+bool Poller::latest(TimedInput &input, InputState &taps)    {
+    TimedInput next;
+    bool any = false;
+    taps = InputState();
+    while(ring.pop(next))    {
+        if(!next.error)
+            for(unsigned player = 0; player < PLAYERS; player++)    {
+                for(unsigned sensor = 0; sensor < MUX_POSITIONS; sensor++)
+                    taps.panels[player][sensor] |= next.state.panels[player][sensor];
+                taps.buttons[player] |= next.state.buttons[player];
+            }
+        input = next;
+        any = true;
+    }
+    return any;
+}
+
+//    Best effort: without the rights for it the thread just runs as it is
+bool Poller::applyRealtime()    {
+    bool ok = true;
+    if(options.cpu >= 0)    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(options.cpu, &set);
+        ok &= pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+    }
+    if(options.priority > 0)    {
+        struct sched_param param;
+        param.sched_priority = options.priority;
+        ok &= pthread_setschedparam(pthread_self(), SCHED_FIFO, &param) == 0;
+    }
+    return ok;
+}
+
+void Poller::run()    {
+    realtimeApplied = applyRealtime();
+    Client client(transport, options.combined);
+    TimedInput input;
+    input.sequence = 0;
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    while(!quit.load(std::memory_order_relaxed))    {
+        uint32_t lamps = lampWord.load(std::memory_order_relaxed);
+        for(unsigned i = 0; i < 4; i++)
+            client.lamps().bytes[i] = lamps >> (i * 8);
+        InputState fresh;
+        input.startNs = now();
+        input.error = client.poll(fresh);
+        input.endNs = now();
+        if(!input.error)
+            input.state = fresh;
+        cycleCount++;
+        if(input.error)
+            errorCount++;
+        if(!ring.push(input))
+            dropCount++;                                        //    The game isn't reading, keep polling
+        input.sequence++;
+        if(input.error == ERROR_NO_DEVICE)
+            break;
+        if(!options.periodUs)
+            continue;
+        int64_t next = deadline.tv_nsec + (int64_t)options.periodUs * 1000;   //    unsigned would wrap from 4.29s on
+        deadline.tv_sec += next / 1000000000;
+        deadline.tv_nsec = next % 1000000000;
+        if(input.endNs > (int64_t)deadline.tv_sec * 1000000000 + deadline.tv_nsec)
+            clock_gettime(CLOCK_MONOTONIC, &deadline);          //    Late, start over from now instead of catching up
+        else
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, 0);
+    }
+    active = false;
+}
+
+}
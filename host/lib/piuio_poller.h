@@ -0,0 +1,125 @@
+/***********************************************************/
+/*    PIUIO host library: polling thread                   */
+/***********************************************************/
+/*    Runs the muxer cycle on its own thread, as fast as   */
+/*    the bus goes or at a fixed period, and hands every   */
+/*    cycle to one consumer (the game thread) through a    */
+/*    lock-free ring, with timestamps. The game then reads */
+/*    inputs that are at most one period old instead of    */
+/*    polling the board from its render loop, and taps     */
+/*    shorter than a render frame are still in the ring.   */
+/*    The lamps go the other way through an atomic, so     */
+/*    setLamps() never waits either.                       */
+/***********************************************************/
+/*                    License is GPLv3                     */
+/*  Please consult https://github.com/racerxdl/piuio_clone */
+/***********************************************************/
+#ifndef PIUIO_POLLER_H
+#define PIUIO_POLLER_H
+
+#include "piuio.h"
+
+#include <thread>
+
+namespace piuio    {
+
+//    Single producer, single consumer ring. SIZE must be a power of two.
+template<typename T, unsigned SIZE>
+class SpscRing    {
+public:
+    SpscRing() : head(0), tail(0)    {}
+
+    //    Producer side. False when full, the item is dropped.
+    bool push(const T &item)    {
+        unsigned h = head.load(std::memory_order_relaxed);
+        if(h - tail.load(std::memory_order_acquire) == SIZE)
+            return false;
+        items[h & (SIZE - 1)] = item;
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+    //    Consumer side. False when empty.
+    bool pop(T &item)    {
+        unsigned t = tail.load(std::memory_order_relaxed);
+        if(t == head.load(std::memory_order_acquire))
+            return false;
+        item = items[t & (SIZE - 1)];
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+private:
+    static_assert((SIZE & (SIZE - 1)) == 0, "SIZE must be a power of two");
+    alignas(64) std::atomic<unsigned> head;    //    Own cache lines, so the two threads
+    alignas(64) std::atomic<unsigned> tail;    //    don't bounce one between them
+    T items[SIZE];
+};
+
+struct PollerOptions    {
+    int cpu;                                    //    CPU to pin the thread to, -1 for any
+    int priority;                               //    SCHED_FIFO priority, 0 for the normal scheduler
+    unsigned periodUs;                          //    Time between cycles, 0 to poll back to back
+    bool combined;                              //    Try the combined request first
+
+    PollerOptions() : cpu(-1), priority(0), periodUs(1000), combined(true)    {}
+};
+
+//    One muxer cycle. Times are Poller::now() before and after it.
+struct TimedInput    {
+    InputState state;
+    uint32_t sequence;
+    int error;                                  //    Not 0 when the cycle failed, state is then the last good one
+    int64_t startNs;
+    int64_t endNs;
+};
+
+class Poller    {
+public:
+    explicit Poller(Transport &transport, const PollerOptions &options = PollerOptions());
+    ~Poller();
+
+    //    Also restarts a thread that stopped by itself
+    int start();
+    void stop();
+    //    False before start(), after stop() and once the thread stopped by
+    //    itself (the board went away). Open the transport again and start().
+    bool running() const                        { return active; }
+
+    //    Game side
+    void setLamps(const LampFrame &lamps);
+    bool pop(TimedInput &input);
+    //    Takes everything queued, returns the newest and ORs the panels
+    //    of all of them in taps, so nothing pressed in between is lost
+    bool latest(TimedInput &input, InputState &taps);
+
+    uint64_t cycles() const                     { return cycleCount; }
+    uint64_t errors() const                     { return errorCount; }
+    uint64_t dropped() const                    { return dropCount; }
+    //    Whether the CPU and priority of the options could be applied
+    bool realtime() const                       { return realtimeApplied; }
+
+    //    CLOCK_MONOTONIC in ns, the clock of the timestamps
+    static int64_t now();
+
+private:
+    Transport &transport;
+    PollerOptions options;
+    std::thread thread;
+    std::atomic<bool> quit;
+    std::atomic<bool> active;
+    std::atomic<uint32_t> lampWord;             //    Lamp bytes 0-3, the only ones the board uses
+    std::atomic<bool> realtimeApplied;
+    std::atomic<uint64_t> cycleCount, errorCount, dropCount;
+    SpscRing<TimedInput, 256> ring;
+
+    void run();
+    bool applyRealtime();
+
+    Poller(const Poller &);
+    Poller &operator=(const Poller &);
+};
+
+}
+
+#endif
@@ -0,0 +1,186 @@
+/***********************************************************/
+/*    PIUIO host library: inputs in shared memory          */
+/***********************************************************/
+/*                    License is GPLv3                     */
+/*  Please consult https://github.com/racerxdl/piuio_clone */
+/***********************************************************/
+#include "piuio_shm.h"
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <thread>
+
+namespace piuio    {
+
+SharedWriter::SharedWriter() : shared(0), lockFd(-1), cycle(0)    {
+    name[0] = 0;
+}
+
+SharedWriter::~SharedWriter()    {
+    close();
+}
+
+int SharedWriter::create(const char *shmName)    {
+    close();
+    int fd = shm_open(shmName, O_CREAT | O_RDWR, 0644);
+    if(fd < 0)
+        return ERROR_IO;
+    if(flock(fd, LOCK_EX | LOCK_NB) < 0)    {                   //    A running writer keeps it locked
+        ::close(fd);
+        return ERROR_BUSY;
+    }
+    void *map = MAP_FAILED;
+    if(ftruncate(fd, sizeof(SharedLayout)) == 0)
+        map = mmap(0, sizeof(SharedLayout), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(map == MAP_FAILED)    {
+        shm_unlink(shmName);
+        ::close(fd);
+        return ERROR_IO;
+    }
+    lockFd = fd;
+    shared = (SharedLayout *)map;                               //    Ours, or left by a writer that died
+    memset((void *)shared, 0, sizeof(SharedLayout));
+    shared->version = SHM_VERSION;
+    std::atomic_thread_fence(std::memory_order_release);
+    shared->magic = SHM_MAGIC;                                  //    Readers check this last
+    snprintf(name, sizeof(name), "%s", shmName);
+    last = InputState();
+    cycle = 0;
+    return OK;
+}
+
+void SharedWriter::close()    {
+    if(!shared)
+        return;
+    shared->magic = 0;
+    munmap(shared, sizeof(SharedLayout));
+    shm_unlink(name);
+    ::close(lockFd);                                            //    Unlinked first, so the next writer gets a new one
+    lockFd = -1;
+    shared = 0;
+}
+
+void SharedWriter::logEdge(int64_t ns, unsigned player, unsigned sensor, uint8_t before, uint8_t after)    {
+    if(before == after)
+        return;
+    uint64_t n = shared->edgeCount.load(std::memory_order_relaxed);
+    SharedEdge &slot = shared->edges[n & (EDGE_SLOTS - 1)];
+    slot.seq.store(0, std::memory_order_relaxed);               //    Readers still on the old edge drop it
+    std::atomic_thread_fence(std::memory_order_release);
+    slot.edge.ns = ns;
+    slot.edge.player = player;
+    slot.edge.sensor = sensor;
+    slot.edge.changed = before ^ after;
+    slot.edge.state = after;
+    slot.seq.store(n + 1, std::memory_order_release);
+    shared->edgeCount.store(n + 1, std::memory_order_release);
+}
+
+void SharedWriter::publish(const InputState &state, int64_t startNs, int64_t endNs, int error)    {
+    if(!shared)
+        return;
+    uint32_t seq = shared->seq.load(std::memory_order_relaxed);
+    shared->seq.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    if(!error)
+        shared->snapshot.state = state;                         //    A failed cycle keeps the last good state
+    shared->snapshot.cycle = ++cycle;
+    shared->snapshot.startNs = startNs;
+    shared->snapshot.endNs = endNs;
+    shared->snapshot.error = error;
+    shared->seq.store(seq + 2, std::memory_order_release);
+    if(error)
+        return;
+    for(unsigned player = 0; player < PLAYERS; player++)    {
+        for(unsigned sensor = 0; sensor < MUX_POSITIONS; sensor++)
+            logEdge(startNs, player, sensor, last.panels[player][sensor], state.panels[player][sensor]);
+        logEdge(startNs, player, SENSOR_BUTTONS, last.buttons[player], state.buttons[player]);
+    }
+    last = state;
+}
+
+SharedReader::SharedReader() : shared(0), next(0)    {
+}
+
+SharedReader::~SharedReader()    {
+    close();
+}
+
+int SharedReader::open(const char *shmName)    {
+    close();
+    int fd = shm_open(shmName, O_RDONLY, 0);
+    if(fd < 0)
+        return ERROR_NO_DEVICE;                                 //    No service running
+    struct stat st;
+    if(fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(SharedLayout))    {
+        ::close(fd);                                            //    Mapping past its end would SIGBUS
+        return ERROR_NO_DEVICE;                                 //    The writer hasn't sized it yet, try again
+    }
+    void *map = mmap(0, sizeof(SharedLayout), PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if(map == MAP_FAILED)
+        return ERROR_IO;
+    shared = (const SharedLayout *)map;
+    if(shared->magic != SHM_MAGIC || shared->version != SHM_VERSION)    {
+        bool starting = !shared->magic;                         //    Set last by create()
+        close();
+        return starting ? ERROR_NO_DEVICE : ERROR_NOT_SUPPORTED;
+    }
+    next = shared->edgeCount.load(std::memory_order_acquire);
+    return OK;
+}
+
+void SharedReader::close()    {
+    if(shared)
+        munmap((void *)shared, sizeof(SharedLayout));
+    shared = 0;
+}
+
+int SharedReader::read(Snapshot &snapshot) const    {
+    if(!shared)
+        return ERROR_NO_DEVICE;
+    for(unsigned tries = 0; tries < SHM_READ_TRIES; tries++)    {
+        uint32_t before = shared->seq.load(std::memory_order_acquire);
+        if(before & 1)    {
+            std::this_thread::yield();                          //    The writer is in there, it's quick unless it died
+            continue;
+        }
+        snapshot = shared->snapshot;
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if(shared->seq.load(std::memory_order_relaxed) == before)
+            return shared->magic == SHM_MAGIC ? OK : ERROR_NO_DEVICE;
+    }
+    return ERROR_TIMEOUT;
+}
+
+unsigned SharedReader::edges(Edge *out, unsigned max, uint64_t *lost)    {
+    if(!shared)
+        return 0;
+    uint64_t count = shared->edgeCount.load(std::memory_order_acquire);
+    uint64_t missed = 0;
+    if(count - next > EDGE_SLOTS)    {                          //    Lapped by the writer
+        missed += count - next - EDGE_SLOTS;
+        next = count - EDGE_SLOTS;
+    }
+    unsigned got = 0;
+    for(; next < count && got < max; next++)    {
+        const SharedEdge &slot = shared->edges[next & (EDGE_SLOTS - 1)];
+        uint64_t before = slot.seq.load(std::memory_order_acquire);
+        Edge edge = slot.edge;
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if(before != next + 1 || slot.seq.load(std::memory_order_relaxed) != before)    {
+            missed++;                                           //    Overwritten while we copied it
+            continue;
+        }
+        out[got++] = edge;
+    }
+    if(lost)
+        *lost += missed;
+    return got;
+}
+
+}
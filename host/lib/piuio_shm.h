@@ -0,0 +1,112 @@
+/***********************************************************/
+/*    PIUIO host library: inputs in shared memory          */
+/***********************************************************/
+/*    Only one process can own the board, so the one that  */
+/*    does publishes every muxer cycle in a POSIX shared   */
+/*    memory object for the others (the game, a lights     */
+/*    daemon, a logger, an overlay). The latest state is   */
+/*    behind a seqlock: the writer never waits, a reader   */
+/*    retries in the rare case it raced a write. Every     */
+/*    change of a sensor or button also goes in an edge    */
+/*    log, a ring each reader follows at its own pace.     */
+/***********************************************************/
+/*                    License is GPLv3                     */
+/*  Please consult https://github.com/racerxdl/piuio_clone */
+/***********************************************************/
+#ifndef PIUIO_SHM_H
+#define PIUIO_SHM_H
+
+#include "piuio.h"
+
+#define PIUIO_SHM_NAME "/piuio"
+
+namespace piuio    {
+
+enum    {
+    SHM_MAGIC       = 0x4F495550,       //    "PUIO"
+    SHM_VERSION     = 1,
+    SHM_READ_TRIES  = 100000,           //    Before a reader gives up on a writer that died in a publish
+    EDGE_SLOTS      = 1024,             //    Must be a power of two
+    SENSOR_BUTTONS  = MUX_POSITIONS     //    Edge.sensor of a button edge
+};
+
+//    One change: which bits of a sensor (or the buttons) moved, and to what
+struct Edge    {
+    int64_t ns;                         //    Poller::now() at the start of the cycle that saw it
+    uint8_t player;
+    uint8_t sensor;                     //    Muxer position, or SENSOR_BUTTONS
+    uint8_t changed;
+    uint8_t state;                      //    All bits of that sensor after the change
+};
+
+struct Snapshot    {
+    InputState state;
+    uint64_t cycle;
+    int64_t startNs, endNs;
+    int32_t error;
+};
+
+struct SharedEdge    {
+    std::atomic<uint64_t> seq;          //    Number of the edge + 1, 0 while it's written
+    Edge edge;
+};
+
+//    What is in the shared memory object
+struct SharedLayout    {
+    uint32_t magic, version;
+    std::atomic<uint32_t> seq;          //    Odd while the writer is in the snapshot
+    Snapshot snapshot;
+    alignas(64) std::atomic<uint64_t> edgeCount;
+    SharedEdge edges[EDGE_SLOTS];
+};
+
+class SharedWriter    {
+public:
+    SharedWriter();
+    ~SharedWriter();
+
+    //    ERROR_BUSY when another writer has it; its segment is left alone
+    int create(const char *name = PIUIO_SHM_NAME);
+    void close();
+    //    Publishes a cycle and logs what changed since the last one
+    void publish(const InputState &state, int64_t startNs, int64_t endNs, int error);
+
+private:
+    SharedLayout *shared;
+    int lockFd;                         //    Open and flock()ed as long as we write
+    char name[64];
+    InputState last;
+    uint64_t cycle;
+
+    void logEdge(int64_t ns, unsigned player, unsigned sensor, uint8_t before, uint8_t after);
+
+    SharedWriter(const SharedWriter &);
+    SharedWriter &operator=(const SharedWriter &);
+};
+
+class SharedReader    {
+public:
+    SharedReader();
+    ~SharedReader();
+
+    //    Starts following the edge log from now on. ERROR_NO_DEVICE when
+    //    there is no writer yet, or it is still setting the segment up.
+    int open(const char *name = PIUIO_SHM_NAME);
+    void close();
+    //    ERROR_TIMEOUT when the writer stays in the snapshot (it died there)
+    int read(Snapshot &snapshot) const;
+    //    Edges since the last call, up to max. lost counts the ones that were
+    //    overwritten before this reader got to them.
+    unsigned edges(Edge *out, unsigned max, uint64_t *lost = 0);
+
+private:
+    const SharedLayout *shared;
+    uint64_t next;
+
+    SharedReader(const SharedReader &);
+    SharedReader &operator=(const SharedReader &);
+};
+
+}
+
+#endif
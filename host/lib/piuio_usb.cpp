@@ -0,0 +1,108 @@
+/***********************************************************/
+/*    PIUIO host library: libusb transport                 */
+/***********************************************************/
+/*                    License is GPLv3                     */
+/*  Please consult https://github.com/racerxdl/piuio_clone */
+/***********************************************************/
+#include "piuio.h"
+
+#include <libusb-1.0/libusb.h>
+
+#define TIMEOUT_MS  100
+
+namespace piuio    {
+
+static int fromLibusb(int r)    {
+    if(r >= 0)
+        return r;
+    switch(r)    {
+        case LIBUSB_ERROR_TIMEOUT:  return ERROR_TIMEOUT;
+        case LIBUSB_ERROR_NO_DEVICE:return ERROR_NO_DEVICE;
+        case LIBUSB_ERROR_PIPE:     return ERROR_NOT_SUPPORTED;
+    }
+    return ERROR_IO;
+}
+
+UsbTransport::UsbTransport() : ctx(0), dev(0), timeout(TIMEOUT_MS)    {
+}
+
+UsbTransport::~UsbTransport()    {
+    close();
+}
+
+int UsbTransport::open(unsigned index)    {
+    close();
+    if(libusb_init(&ctx) < 0)    {
+        ctx = 0;
+        return ERROR_IO;
+    }
+    libusb_device **list;
+    ssize_t count = libusb_get_device_list(ctx, &list);
+    int r = ERROR_NO_DEVICE;
+    for(ssize_t i = 0; i < count; i++)    {
+        libusb_device_descriptor desc;
+        if(libusb_get_device_descriptor(list[i], &desc) < 0 || desc.idVendor != VID || desc.idProduct != PID)
+            continue;
+        if(index--)
+            continue;
+        r = fromLibusb(libusb_open(list[i], &dev));
+        break;
+    }
+    if(count >= 0)
+        libusb_free_device_list(list, 1);
+    if(r < 0)
+        close();
+    return r < 0 ? r : OK;
+}
+
+void UsbTransport::close()    {
+    if(dev)
+        libusb_close(dev);
+    if(ctx)
+        libusb_exit(ctx);
+    dev = 0;
+    ctx = 0;
+}
+
+int UsbTransport::writeLamps(const LampFrame &lamps)    {
+    if(!dev)
+        return ERROR_NO_DEVICE;
+    int r = libusb_control_transfer(dev, LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_ENDPOINT_OUT, REQUEST, 0, 0,
+                                    (unsigned char *)lamps.bytes, sizeof(lamps.bytes), timeout);
+    if(r == LIBUSB_ERROR_PIPE)
+        return ERROR_IO;                                        //    Every board knows this one
+    return r < 0 ? fromLibusb(r) : OK;
+}
+
+int UsbTransport::readInputs(InputFrame &input)    {
+    if(!dev)
+        return ERROR_NO_DEVICE;
+    int r = libusb_control_transfer(dev, LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_ENDPOINT_IN, REQUEST, 0, 0,
+                                    input.bytes, sizeof(input.bytes), timeout);
+    if(r == LIBUSB_ERROR_PIPE || (r >= 0 && r != (int)sizeof(input.bytes)))
+        return ERROR_IO;
+    return r < 0 ? fromLibusb(r) : OK;
+}
+
+int UsbTransport::exchange(const LampFrame &lamps, InputFrame &input)    {
+    if(!dev)
+        return ERROR_NO_DEVICE;
+    int r = libusb_control_transfer(dev, LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_ENDPOINT_IN, COMBINED_REQUEST,
+                                    lamps.value(), lamps.index(), input.bytes, sizeof(input.bytes), timeout);
+    if(r >= 0 && r != (int)sizeof(input.bytes))
+        return ERROR_IO;
+    return r < 0 ? fromLibusb(r) : OK;
+}
+
+int UsbTransport::readHistory(uint16_t first, HistoryFrame *frames, unsigned max)    {
+    if(!dev)
+        return ERROR_NO_DEVICE;
+    unsigned char reply[4 + HISTORY_FRAMES * 4];
+    if(max > HISTORY_FRAMES)
+        max = HISTORY_FRAMES;
+    int r = libusb_control_transfer(dev, LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_ENDPOINT_IN, HISTORY_REQUEST,
+                                    first, 0, reply, 4 + max * 4, timeout);
+    return r < 0 ? fromLibusb(r) : decodeHistory(reply, r, frames, max);
+}
+
+}
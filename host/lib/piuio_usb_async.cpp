@@ -0,0 +1,205 @@
+/***********************************************************/
+/*    PIUIO host library: async libusb for the Manager     */
+/***********************************************************/
+/*    libusb hands out the fds it waits on (and, on Linux, */
+/*    a timerfd for its timeouts), they go in the epoll of */
+/*    the Manager, and when one of them is ready libusb    */
+/*    runs the callbacks of the transfers that finished    */
+/*    without blocking.                                    */
+/***********************************************************/
+/*                    License is GPLv3                     */
+/*  Please consult https://github.com/racerxdl/piuio_clone */
+/***********************************************************/
+#include "piuio_manager.h"
+
+#include <libusb-1.0/libusb.h>
+#include <poll.h>
+
+#define TIMEOUT_MS  100
+#define DETACH_WAIT_MS 1000                                     //    On top of the transfer timeout, for the cancelled transfers
+
+namespace piuio    {
+
+struct UsbBus::Board    {
+    Manager *manager;                                           //    0 once detaching
+    unsigned *cancelled;                                        //    Set once detaching with a transfer in flight, see freeBoard()
+    unsigned device;
+    libusb_device_handle *dev;
+    libusb_transfer *transfer;
+    Transfer *pending;
+    unsigned char buffer[LIBUSB_CONTROL_SETUP_SIZE + sizeof(InputFrame)];
+};
+
+//    A board detached with a transfer in flight is left to the callback of
+//    that transfer, the only one that knows when libusb is done with it
+static void freeBoard(UsbBus::Board *board)    {
+    libusb_free_transfer(board->transfer);
+    libusb_close(board->dev);
+    delete board;
+}
+
+static void LIBUSB_CALL onTransfer(libusb_transfer *usb)    {
+    UsbBus::Board *board = (UsbBus::Board *)usb->user_data;
+    Transfer *transfer = board->pending;
+    board->pending = 0;
+    if(board->cancelled)    {
+        (*board->cancelled)--;
+        freeBoard(board);
+        return;
+    }
+    if(!transfer || !board->manager)
+        return;
+    switch(usb->status)    {
+        case LIBUSB_TRANSFER_COMPLETED:
+            if(transfer->kind == Transfer::WRITE)
+                transfer->result = OK;
+            else if(usb->actual_length != (int)sizeof(transfer->input.bytes))
+                transfer->result = ERROR_IO;
+            else    {
+                memcpy(transfer->input.bytes, libusb_control_transfer_get_data(usb), sizeof(transfer->input.bytes));
+                transfer->result = OK;
+            }
+            break;
+        case LIBUSB_TRANSFER_TIMED_OUT:
+            transfer->result = ERROR_TIMEOUT;
+            break;
+        case LIBUSB_TRANSFER_NO_DEVICE:
+            transfer->result = ERROR_NO_DEVICE;
+            break;
+        case LIBUSB_TRANSFER_STALL:                             //    Every board knows 0xAE
+            transfer->result = transfer->kind == Transfer::EXCHANGE ? ERROR_NOT_SUPPORTED : ERROR_IO;
+            break;
+        default:
+            transfer->result = ERROR_IO;
+    }
+    board->manager->completed(board->device);
+}
+
+static void LIBUSB_CALL onPollfdAdded(int fd, short events, void *manager)    {
+    ((Manager *)manager)->watch(fd, events & POLLOUT);
+}
+
+static void LIBUSB_CALL onPollfdRemoved(int fd, void *manager)    {
+    ((Manager *)manager)->unwatch(fd);
+}
+
+UsbBus::UsbBus() : ctx(0), manager(0), timeout(TIMEOUT_MS), cancelled(0)    {
+}
+
+UsbBus::~UsbBus()    {
+    detach();
+}
+
+int UsbBus::attach(Manager &manager)    {
+    detach();
+    if(ctx)
+        return ERROR_IO;                                        //    Still letting the last boards go
+    if(libusb_init(&ctx) < 0)    {
+        ctx = 0;
+        return ERROR_IO;
+    }
+    this->manager = &manager;
+    libusb_device **list;
+    ssize_t count = libusb_get_device_list(ctx, &list);
+    for(ssize_t i = 0; i < count; i++)    {
+        libusb_device_descriptor desc;
+        if(libusb_get_device_descriptor(list[i], &desc) < 0 || desc.idVendor != VID || desc.idProduct != PID)
+            continue;
+        libusb_device_handle *dev;
+        if(libusb_open(list[i], &dev) < 0)
+            continue;                                           //    Someone else's, or no rights on it
+        Board *board = new Board;
+        board->manager = &manager;
+        board->cancelled = 0;
+        board->dev = dev;
+        board->transfer = libusb_alloc_transfer(0);
+        board->pending = 0;
+        board->device = manager.addDevice();
+        boards.push_back(board);
+    }
+    if(count >= 0)
+        libusb_free_device_list(list, 1);
+
+    const libusb_pollfd **fds = libusb_get_pollfds(ctx);
+    for(unsigned i = 0; fds && fds[i]; i++)
+        manager.watch(fds[i]->fd, fds[i]->events & POLLOUT);
+    libusb_free_pollfds(fds);
+    libusb_set_pollfd_notifiers(ctx, onPollfdAdded, onPollfdRemoved, &manager);
+    if(boards.empty())    {
+        detach();
+        return ERROR_NO_DEVICE;
+    }
+    return OK;
+}
+
+void UsbBus::detach()    {
+    if(!ctx)
+        return;
+    if(manager)    {
+        libusb_set_pollfd_notifiers(ctx, 0, 0, 0);
+        const libusb_pollfd **fds = libusb_get_pollfds(ctx);
+        for(unsigned i = 0; fds && fds[i]; i++)
+            manager->unwatch(fds[i]->fd);
+        libusb_free_pollfds(fds);
+        manager = 0;
+    }
+    for(unsigned device = 0; device < boards.size(); device++)    {
+        Board *board = boards[device];
+        board->manager = 0;
+        if(!board->pending)    {
+            freeBoard(board);
+            continue;
+        }
+        board->cancelled = &cancelled;                          //    Its callback frees it
+        cancelled++;
+        libusb_cancel_transfer(board->transfer);
+    }
+    boards.clear();
+    //    A cancelled transfer always completes, at the latest when its own
+    //    timeout runs out, and libusb has to be there to run the callback
+    for(unsigned tries = 0; cancelled && tries < (timeout + DETACH_WAIT_MS) / 10; tries++)    {
+        struct timeval tv = { 0, 10000 };
+        libusb_handle_events_timeout_completed(ctx, &tv, 0);
+    }
+    if(cancelled)
+        return;                                                 //    Kept, the next detach() waits for them again
+    libusb_exit(ctx);
+    ctx = 0;
+}
+
+int UsbBus::submit(unsigned device, Transfer &transfer)    {
+    Board *board = boards[device];
+    if(!board->transfer)
+        return ERROR_IO;
+    bool out = transfer.kind == Transfer::WRITE;
+    bool combined = transfer.kind == Transfer::EXCHANGE;
+    libusb_fill_control_setup(board->buffer, LIBUSB_REQUEST_TYPE_VENDOR | (out ? LIBUSB_ENDPOINT_OUT : LIBUSB_ENDPOINT_IN),
+                              combined ? COMBINED_REQUEST : REQUEST, combined ? transfer.lamps.value() : 0,
+                              combined ? transfer.lamps.index() : 0, sizeof(transfer.lamps.bytes));
+    if(out)
+        memcpy(board->buffer + LIBUSB_CONTROL_SETUP_SIZE, transfer.lamps.bytes, sizeof(transfer.lamps.bytes));
+    libusb_fill_control_transfer(board->transfer, board->dev, board->buffer, onTransfer, board, timeout);
+    board->pending = &transfer;
+    int r = libusb_submit_transfer(board->transfer);
+    if(r < 0)    {
+        board->pending = 0;
+        return r == LIBUSB_ERROR_NO_DEVICE ? ERROR_NO_DEVICE : ERROR_IO;
+    }
+    return OK;
+}
+
+void UsbBus::ready(int)    {
+    struct timeval zero = { 0, 0 };
+    if(ctx)
+        libusb_handle_events_timeout_completed(ctx, &zero, 0);
+}
+
+//    Only when libusb can't give us a timerfd for its timeouts
+int UsbBus::timeoutMs()    {
+    struct timeval tv;
+    if(!ctx || libusb_pollfds_handle_timeouts(ctx) || libusb_get_next_timeout(ctx, &tv) != 1)
+        return -1;
+    return tv.tv_sec * 1000 + (tv.tv_usec + 999) / 1000;
+}
+
+}
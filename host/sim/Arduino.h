@@ -0,0 +1,23 @@
+//    Host stand-in for the Arduino core. See sim.h
+#ifndef PIUIO_SIM_ARDUINO_H
+#define PIUIO_SIM_ARDUINO_H
+
+#include "sim.h"
+#include <avr/io.h>
+#include <avr/interrupt.h>
+
+#ifndef F_CPU
+#define F_CPU 16000000UL
+#endif
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+#define LSBFIRST 0
+#define MSBFIRST 1
+
+inline void delayMicroseconds(unsigned int)    { }
+inline unsigned long micros()                  { return sim::micros(); }
+inline unsigned long millis()                  { return sim::micros() / 1000; }
+
+#endif
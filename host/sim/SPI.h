@@ -0,0 +1,17 @@
+//    Host stand-in for the Arduino SPI library. See sim.h
+#ifndef PIUIO_SIM_SPI_H
+#define PIUIO_SIM_SPI_H
+
+#include "Arduino.h"
+
+class SPIClass {
+public:
+    static void begin()                         { }
+    static void end()                           { }
+    static void setBitOrder(uint8_t)            { }
+    static uint8_t transfer(uint8_t data)       { return sim::spiExchange(data); }
+};
+
+extern SPIClass SPI;
+
+#endif
@@ -0,0 +1,20 @@
+//    Host stand-in for <avr/eeprom.h>. The EEPROM is an array that starts
+//    erased and is always ready.
+#ifndef PIUIO_SIM_AVR_EEPROM_H
+#define PIUIO_SIM_AVR_EEPROM_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define PIUIO_SIM_EEPROM_SIZE 1024
+
+namespace sim    {
+extern uint8_t eeprom[PIUIO_SIM_EEPROM_SIZE];
+}
+
+inline bool eeprom_is_ready(void)                       { return true; }
+inline uint8_t eeprom_read_byte(const uint8_t *addr)    { return sim::eeprom[(uintptr_t)addr]; }
+inline void eeprom_update_byte(uint8_t *addr, uint8_t v)    { sim::eeprom[(uintptr_t)addr] = v; }
+inline void eeprom_read_block(void *dst, const void *src, size_t n)    { memcpy(dst, sim::eeprom + (uintptr_t)src, n); }
+
+#endif
@@ -0,0 +1,12 @@
+//    Host stand-in for <avr/interrupt.h>. There are no interrupts on the
+//    host, a bench calls the handlers itself.
+#ifndef PIUIO_SIM_AVR_INTERRUPT_H
+#define PIUIO_SIM_AVR_INTERRUPT_H
+
+#define ISR(vector, ...) void vector(void)
+#define ISR_NOBLOCK
+
+inline void sei(void)   { }
+inline void cli(void)   { }
+
+#endif
@@ -0,0 +1,24 @@
+//    Host stand-in for <avr/io.h>. The registers are SimReg, see sim.h
+#ifndef PIUIO_SIM_AVR_IO_H
+#define PIUIO_SIM_AVR_IO_H
+
+#include "../sim.h"
+
+//    SPI
+#define SPIF    7
+#define WCOL    6
+
+//    Timer1
+#define CS10    0
+#define CS11    1
+#define CS12    2
+#define WGM12   3
+
+//    Timer2
+#define CS20    0
+#define CS21    1
+#define CS22    2
+#define WGM21   1
+#define OCIE2A  1
+
+#endif
@@ -0,0 +1,8 @@
+//    Host stand-in for <avr/pgmspace.h>
+#ifndef PIUIO_SIM_AVR_PGMSPACE_H
+#define PIUIO_SIM_AVR_PGMSPACE_H
+
+#define PROGMEM
+#define pgm_read_byte(addr) (*(const unsigned char *)(addr))
+
+#endif
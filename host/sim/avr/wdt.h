@@ -0,0 +1,10 @@
+//    Host stand-in for <avr/wdt.h>
+#ifndef PIUIO_SIM_AVR_WDT_H
+#define PIUIO_SIM_AVR_WDT_H
+
+#define WDTO_1S 6
+
+inline void wdt_enable(int)     { }
+inline void wdt_reset(void)     { }
+
+#endif
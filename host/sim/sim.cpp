@@ -0,0 +1,219 @@
+//    Host simulation runtime: registers, SPI and the V-USB control pipe.
+//    See sim.h
+#include "sim.h"
+#include "SPI.h"
+#include "usbdrv.h"
+#include "Arduino.h"
+#include "avr/eeprom.h"
+
+#include <string.h>
+#include <chrono>
+
+#define SIM_DEFINE_REG(type, name) type name;
+SIM_REGISTERS(SIM_DEFINE_REG)
+#undef SIM_DEFINE_REG
+
+SPIClass SPI;
+uchar *usbMsgPtr;
+
+namespace sim {
+
+Stats stats;
+uint8_t (*spiHook)(uint8_t out);
+uint8_t eeprom[PIUIO_SIM_EEPROM_SIZE];
+
+//    Erased, as a new chip comes. reset() leaves it alone, like a real reset.
+static struct EepromErased    {
+    EepromErased()    { memset(eeprom, 0xFF, sizeof(eeprom)); }
+} eepromErased;
+
+static Board current;
+
+//    Writing SPDR shifts a byte right away and raises SPIF, any access to
+//    SPDR clears it again.
+static void spdrWrite(uint8_t value)    {
+    SPSR.value &= ~(1 << SPIF);
+    SPDR.value = spiExchange(value);
+    SPSR.value |= 1 << SPIF;
+}
+
+static uint8_t spdrRead(uint8_t value)    {
+    SPSR.value &= ~(1 << SPIF);
+    return value;
+}
+
+static uint16_t tcnt1Read(uint16_t)    {
+    return (uint16_t)(micros() / 4);
+}
+
+//    Runs the Timer2 compare interrupt as many times as it would have
+//    fired since the last call, in CTC mode with the prescaler in TCCR2B.
+static unsigned long timer2Last;
+
+static void serviceTimer2()    {
+    static const unsigned prescale[8] = { 0, 1, 8, 32, 64, 128, 256, 1024 };
+    unsigned div = prescale[TCCR2B.value & 7];
+    if(!current.timer2Compare || !div || !(TIMSK2.value & (1 << OCIE2A)))
+        return;
+    unsigned long period = (unsigned long)(OCR2A.value + 1) * div / (F_CPU / 1000000UL);
+    unsigned long now = micros();
+    if(!period)
+        period = 1;
+    while(now - timer2Last >= period)    {
+        timer2Last += period;
+        current.timer2Compare();
+    }
+}
+static Transfer *pending;
+static uchar interruptData[8];
+static int interruptLen = -1;                       //    -1 when the endpoint is free
+
+const Board &board()    {
+    return current;
+}
+
+void reset()    {
+#define SIM_RESET_REG(type, name) name.value = 0; name.onRead = 0; name.onWrite = 0;
+    SIM_REGISTERS(SIM_RESET_REG)
+#undef SIM_RESET_REG
+    SPDR.onWrite = spdrWrite;
+    SPDR.onRead = spdrRead;
+    TCNT1.onRead = tcnt1Read;
+    spiHook = 0;
+    timer2Last = micros();
+    pending = 0;
+    interruptLen = -1;
+    usbMsgPtr = 0;
+    memset(&stats, 0, sizeof(stats));
+}
+
+void attach(const Board &b)    {
+    reset();
+    current = b;
+    current.setup();
+}
+
+void submit(Transfer &t, uchar bmRequestType, uchar bRequest,
+            unsigned wValue, unsigned wIndex, unsigned wLength, const uchar *data)    {
+    t.setup[0] = bmRequestType;
+    t.setup[1] = bRequest;
+    t.setup[2] = wValue & 0xFF;
+    t.setup[3] = wValue >> 8;
+    t.setup[4] = wIndex & 0xFF;
+    t.setup[5] = wIndex >> 8;
+    t.setup[6] = wLength & 0xFF;
+    t.setup[7] = wLength >> 8;
+    if(data && !(bmRequestType & 0x80))
+        memcpy(t.data, data, wLength < sizeof(t.data) ? wLength : sizeof(t.data));
+    t.result = 0;
+    t.done = false;
+    pending = &t;
+}
+
+int controlTransfer(uchar bmRequestType, uchar bRequest, unsigned wValue,
+                    unsigned wIndex, uchar *data, unsigned wLength)    {
+    Transfer t;
+    submit(t, bmRequestType, bRequest, wValue, wIndex, wLength, data);
+    while(!t.done)
+        current.loop();
+    if(data && (bmRequestType & 0x80) && t.result > 0)
+        memcpy(data, t.data, t.result);
+    return t.result;
+}
+
+//    Same rules as usbProcessRx()/usbBuildTxBlock() in usbdrv.c, but the
+//    whole transfer is played in one go.
+static void runTransfer(Transfer &t)    {
+    usbRequest_t *rq = (usbRequest_t *)t.setup;
+    unsigned wLength = t.setup[6] | (t.setup[7] << 8);
+    uchar setup[8];
+    memcpy(setup, t.setup, 8);
+    usbMsgLen_t replyLen = current.functionSetup(setup);
+    t.result = 0;
+    if(rq->bmRequestType & 0x80)    {                   //    Control-in
+        if(replyLen == USB_NO_MSG)    {
+            if(!current.functionRead)    {
+                t.result = -1;
+                return;
+            }
+            for(unsigned done = 0; done < wLength; )    {
+                uchar want = wLength - done > 8 ? 8 : wLength - done;
+                uchar got = current.functionRead(t.data + done, want);
+                if(got == 0xFF)    {
+                    t.result = -1;
+                    return;
+                }
+                done += got;
+                t.result = done;
+                if(got < 8)
+                    break;
+            }
+        }else    {
+            if(replyLen > wLength)
+                replyLen = wLength;
+            memcpy(t.data, usbMsgPtr, replyLen);
+            t.result = replyLen;
+        }
+    }else if(replyLen == USB_NO_MSG)    {              //    Control-out through usbFunctionWrite()
+        for(unsigned done = 0; done < wLength; )    {
+            uchar len = wLength - done > 8 ? 8 : wLength - done;
+            uchar rval = current.functionWrite(t.data + done, len);
+            if(rval == 0xFF)    {
+                t.result = -1;
+                return;
+            }
+            done += len;
+            t.result = done;
+            if(rval)
+                break;
+        }
+    }
+}
+
+int readInterrupt(uchar *data)    {
+    if(interruptLen < 0)
+        return 0;
+    int len = interruptLen;
+    memcpy(data, interruptData, len);
+    interruptLen = -1;
+    return len;
+}
+
+uint8_t spiExchange(uint8_t out)    {
+    stats.spiBytes++;
+    return spiHook ? spiHook(out) : 0;
+}
+
+unsigned long micros()    {
+    using namespace std::chrono;
+    static const steady_clock::time_point start = steady_clock::now();
+    return (unsigned long)duration_cast<microseconds>(steady_clock::now() - start).count();
+}
+
+}
+
+void usbInit(void)               { }
+void usbDeviceConnect(void)      { }
+void usbDeviceDisconnect(void)   { }
+
+void usbPoll(void)    {
+    sim::stats.usbPolls++;
+    sim::serviceTimer2();
+    if(sim::pending)    {
+        sim::Transfer &t = *sim::pending;
+        sim::pending = 0;
+        sim::runTransfer(t);
+        sim::stats.transfers++;
+        t.done = true;
+    }
+}
+
+void usbSetInterrupt(uchar *data, uchar len)    {
+    sim::stats.interrupts++;
+    memcpy(sim::interruptData, data, len > 8 ? 8 : len);
+    sim::interruptLen = len > 8 ? 8 : len;
+}
+
+bool usbInterruptIsReady(void)    {
+    return sim::interruptLen < 0;
+}
@@ -0,0 +1,119 @@
+/***********************************************************/
+/*   ____ ___ _   _ ___ ___     ____ _                     */
+/*  |  _ \_ _| | | |_ _/ _ \   / ___| | ___  _ __   ___    */
+/*  | |_) | || | | || | | | | | |   | |/ _ \| '_ \ / _ \   */
+/*  |  __/| || |_| || | |_| | | |___| | (_) | | | |  __/   */
+/*  |_|  |___|\___/|___\___/   \____|_|\___/|_| |_|\___|   */
+/*                                                         */
+/***********************************************************/
+/*    Host simulation of the bits of AVR, Arduino and      */
+/*    V-USB that the sketches touch. The headers in this   */
+/*    folder stand in for <avr/io.h>, <SPI.h>, <usbdrv.h>  */
+/*    so the very same .ino files build on Linux. On the   */
+/*    board nothing here is used, so the AVR code is the   */
+/*    same it always was.                                  */
+/***********************************************************/
+/*                    License is GPLv3                     */
+/*  Please consult https://github.com/racerxdl/piuio_clone */
+/***********************************************************/
+#ifndef PIUIO_SIM_H
+#define PIUIO_SIM_H
+
+#include <stdint.h>
+
+#include "usbconfig.h"
+
+#ifndef uchar
+#define uchar   unsigned char
+#endif
+
+//    As V-USB has it, usbdrv.h gets it from here
+#if USB_CFG_LONG_TRANSFERS
+#   define usbMsgLen_t unsigned
+#else
+#   define usbMsgLen_t uchar
+#endif
+
+//    A mocked I/O register. Reads and writes can be hooked so a bench can
+//    model what is wired to the pins (like the 4067 muxer) or a timer.
+template<typename T> struct SimRegister {
+    T value;
+    T (*onRead)(T value);                       //    Optional, returns what the pins show
+    void (*onWrite)(T value);                   //    Optional, called after every write
+
+    operator T() const                      { return onRead ? onRead(value) : value; }
+    SimRegister &operator=(const SimRegister &r) { return *this = (T)r; }
+    SimRegister &operator=(unsigned v)      { value = (T)v; if(onWrite) onWrite(value); return *this; }
+    SimRegister &operator|=(unsigned v)     { return *this = (T)(value | v); }
+    SimRegister &operator&=(unsigned v)     { return *this = (T)(value & v); }
+    SimRegister &operator^=(unsigned v)     { return *this = (T)(value ^ v); }
+};
+typedef SimRegister<uint8_t> SimReg;
+typedef SimRegister<uint16_t> SimReg16;
+
+//    Every register the sketches use, on any board profile.
+#define SIM_REGISTERS(X) \
+    X(SimReg, DDRA) X(SimReg, PORTA) \
+    X(SimReg, PINB) X(SimReg, DDRB) X(SimReg, PORTB) X(SimReg, PINC) X(SimReg, DDRC) X(SimReg, PORTC) \
+    X(SimReg, PIND) X(SimReg, DDRD) X(SimReg, PORTD) X(SimReg, PINF) X(SimReg, DDRF) X(SimReg, PORTF) \
+    X(SimReg, PING) X(SimReg, DDRG) X(SimReg, PORTG) X(SimReg, PINK) X(SimReg, DDRK) X(SimReg, PORTK) \
+    X(SimReg, PINL) X(SimReg, DDRL) X(SimReg, PORTL) X(SimReg, SPCR) X(SimReg, SPSR) X(SimReg, SPDR) \
+    X(SimReg, TCCR1A) X(SimReg, TCCR1B) X(SimReg16, TCNT1) \
+    X(SimReg, TCCR2A) X(SimReg, TCCR2B) X(SimReg, OCR2A) X(SimReg, TIMSK2) X(SimReg, GPIOR0)
+
+#define SIM_DECLARE_REG(type, name) extern type name;
+SIM_REGISTERS(SIM_DECLARE_REG)
+#undef SIM_DECLARE_REG
+
+namespace sim {
+
+//    What a sketch exports. The bench includes every sketch in its own
+//    namespace and hands one of these to attach().
+struct Board {
+    const char *name;
+    void (*setup)(void);
+    void (*loop)(void);
+    void (*poll)(void);                             //    pollInputOutput(), or what runs per lamp frame
+    usbMsgLen_t (*functionSetup)(uchar data[8]);
+    uchar (*functionWrite)(uchar *data, uchar len);
+    uchar (*functionRead)(uchar *data, uchar len);   //    May be 0
+    void (*timer2Compare)(void);                    //    TIMER2_COMPA_vect, may be 0
+};
+
+//    A control transfer as the host sees it. It is answered by the next
+//    usbPoll() of the attached board, like V-USB does on the real thing.
+struct Transfer {
+    uchar setup[8];
+    uchar data[256];
+    int result;                                     //    Bytes moved, or -1 for STALL
+    volatile bool done;
+};
+
+struct Stats {
+    unsigned long usbPolls;                         //    usbPoll() calls
+    unsigned long transfers;                        //    Control transfers answered
+    unsigned long spiBytes;                         //    Bytes clocked out over SPI
+    unsigned long interrupts;                       //    Reports queued with usbSetInterrupt()
+};
+
+extern Stats stats;
+
+void attach(const Board &board);                    //    Select board, reset registers and run setup()
+const Board &board();
+void reset();                                       //    Clear registers, hooks and stats
+
+void submit(Transfer &t, uchar bmRequestType, uchar bRequest,
+            unsigned wValue, unsigned wIndex, unsigned wLength, const uchar *data = 0);
+int controlTransfer(uchar bmRequestType, uchar bRequest, unsigned wValue,
+            unsigned wIndex, uchar *data, unsigned wLength);   //    Submit and spin loop() until done
+
+int readInterrupt(uchar *data);                     //    Host IN token on endpoint 1, returns 0 for NAK
+
+uint8_t spiExchange(uint8_t out);                   //    What SPI.transfer() ends up calling
+extern uint8_t (*spiHook)(uint8_t out);             //    Optional, models the devices on the bus
+
+unsigned long micros();                             //    Host time; TCNT1 reads micros() / 4 like F_CPU/64 at 16MHz
+
+}
+
+#endif
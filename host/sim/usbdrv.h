@@ -0,0 +1,43 @@
+//    Host stand-in for V-USB. Only the application side API is here, the
+//    transfers are played by sim::submit() and answered in usbPoll().
+#ifndef __usbdrv_h_included__
+#define __usbdrv_h_included__
+
+#include "sim.h"
+#include "usbconfig.h"
+
+#ifndef USB_PUBLIC
+#define USB_PUBLIC
+#endif
+#ifndef schar
+#define schar   signed char
+#endif
+
+#define USB_NO_MSG  ((usbMsgLen_t)-1)
+
+typedef union usbWord{
+    uint16_t    word;
+    uchar       bytes[2];
+}usbWord_t;
+
+typedef struct usbRequest{
+    uchar       bmRequestType;
+    uchar       bRequest;
+    usbWord_t   wValue;
+    usbWord_t   wIndex;
+    usbWord_t   wLength;
+}usbRequest_t;
+
+extern uchar *usbMsgPtr;
+
+void usbInit(void);
+void usbPoll(void);
+void usbDeviceConnect(void);
+void usbDeviceDisconnect(void);
+
+#if USB_CFG_HAVE_INTRIN_ENDPOINT
+void usbSetInterrupt(uchar *data, uchar len);
+bool usbInterruptIsReady(void);
+#endif
+
+#endif
@@ -0,0 +1,100 @@
+/***********************************************************/
+/*    Reference client for the combined request (0xB1)     */
+/***********************************************************/
+/*    Cycles the 4 muxer positions like the game does and  */
+/*    reads the pads, either with one combined transfer    */
+/*    per sample or with the legacy 0x40 write + 0xC0 read */
+/*    pair, and prints the sample rate of both.            */
+/*                                                         */
+/*    Build from the repository root:                      */
+/*      g++ -O2 -std=c++11 \                               */
+/*          host/tools/combined_client.cpp \               */
+/*          -o combined_client -lusb-1.0                   */
+/*    Run: ./combined_client [--legacy] [seconds]          */
+/***********************************************************/
+#include <libusb-1.0/libusb.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+
+#define PIUIO_VID           0x0547
+#define PIUIO_PID           0x1002
+#define PIUIO_REQUEST       0xAE    //    Legacy lamp write / input read
+#define COMBINED_REQUEST    0xB1    //    Lamps in wValue/wIndex, inputs back
+#define TIMEOUT_MS          100
+
+//    One sample the legacy way: lamps with ZZ, then read the pads
+static int legacySample(libusb_device_handle *dev, const unsigned char lamps[8], unsigned char input[8])    {
+    int r = libusb_control_transfer(dev, LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_ENDPOINT_OUT,
+                                    PIUIO_REQUEST, 0, 0, (unsigned char *)lamps, 8, TIMEOUT_MS);
+    if(r < 0)
+        return r;
+    return libusb_control_transfer(dev, LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_ENDPOINT_IN,
+                                   PIUIO_REQUEST, 0, 0, input, 8, TIMEOUT_MS);
+}
+
+//    The same sample in one transfer: lamp bytes 0-1 in wValue, 2-3 in wIndex
+static int combinedSample(libusb_device_handle *dev, const unsigned char lamps[8], unsigned char input[8])    {
+    return libusb_control_transfer(dev, LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_ENDPOINT_IN,
+                                   COMBINED_REQUEST, lamps[0] | (lamps[1] << 8),
+                                   lamps[2] | (lamps[3] << 8), input, 8, TIMEOUT_MS);
+}
+
+int main(int argc, char **argv)    {
+    bool legacy = false;
+    double seconds = 5;
+    for(int i = 1; i < argc; i++)    {
+        if(!strcmp(argv[i], "--legacy"))
+            legacy = true;
+        else
+            seconds = atof(argv[i]);
+    }
+
+    libusb_context *ctx;
+    if(libusb_init(&ctx) < 0)    {
+        fprintf(stderr, "libusb_init failed\n");
+        return 1;
+    }
+    libusb_device_handle *dev = libusb_open_device_with_vid_pid(ctx, PIUIO_VID, PIUIO_PID);
+    if(!dev)    {
+        fprintf(stderr, "No PIUIO (%04x:%04x) found\n", PIUIO_VID, PIUIO_PID);
+        libusb_exit(ctx);
+        return 1;
+    }
+
+    unsigned char lamps[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
+    unsigned char input[4][8];                              //    One report per muxer position
+    unsigned long samples = 0;
+    typedef std::chrono::steady_clock Clock;
+    Clock::time_point start = Clock::now();
+    double elapsed = 0;
+    int r = 0;
+    while(elapsed < seconds)    {
+        for(unsigned char zz = 0; zz < 4; zz++)    {
+            lamps[0] = (lamps[0] & 0xFC) | zz;              //    ZZ of P1
+            lamps[2] = (lamps[2] & 0xFC) | zz;              //    ZZ of P2
+            r = legacy ? legacySample(dev, lamps, input[zz]) : combinedSample(dev, lamps, input[zz]);
+            if(r < 0)
+                break;
+            samples++;
+        }
+        if(r < 0)    {
+            fprintf(stderr, "Transfer failed: %s\n", libusb_error_name(r));
+            break;
+        }
+        elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+        printf("\rP1 %02X %02X %02X %02X  P2 %02X %02X %02X %02X  %7.1f samples/s",
+               input[0][0], input[1][0], input[2][0], input[3][0],
+               input[0][2], input[1][2], input[2][2], input[3][2], samples / elapsed);
+        fflush(stdout);
+    }
+    printf("\n%s: %lu samples in %.2fs, %.1f samples/s, %.3f ms per sample\n",
+           legacy ? "legacy 0x40+0xC0" : "combined 0xB1", samples, elapsed,
+           samples / elapsed, elapsed * 1000 / (samples ? samples : 1));
+
+    libusb_close(dev);
+    libusb_exit(ctx);
+    return r < 0;
+}
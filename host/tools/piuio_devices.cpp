@@ -0,0 +1,120 @@
+/***********************************************************/
+/*    Every board on one loop                              */
+/***********************************************************/
+/*    Runs the muxer cycle of all the boards plugged in    */
+/*    with piuio::Manager and prints, every second, how    */
+/*    many cycles and transfers each one did, how long     */
+/*    they took and what is pressed on it. With --sim N it */
+/*    runs on N boards in memory instead, each transfer    */
+/*    taking transfer_us, with a step going around each.   */
+/*    The pressed panels are lit. -w and --merged set the  */
+/*    LampFilter of the boards without the combined        */
+/*    request, "skipped" is the lamp writes it dropped.    */
+/*                                                         */
+/*    Build from the repository root:                      */
+/*      g++ -O2 -std=c++11 -Ihost/lib \                    */
+/*          host/lib/piuio.cpp host/lib/piuio_mock.cpp \   */
+/*          host/lib/piuio_poller.cpp \                    */
+/*          host/lib/piuio_coalesce.cpp \                  */
+/*          host/lib/piuio_manager.cpp \                   */
+/*          host/lib/piuio_usb_async.cpp \                 */
+/*          host/tools/piuio_devices.cpp \                 */
+/*          -o piuio_devices -lusb-1.0 -lpthread           */
+/*    Run: ./piuio_devices [--sim N] [-t transfer_us]      */
+/*           [--legacy] [-w window_us] [--merged] [seconds]*/
+/***********************************************************/
+#include <piuio_manager.h>
+#include <piuio_poller.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void print(piuio::Manager &manager, std::vector<piuio::DeviceStats> &last, std::vector<uint64_t> &skipped,
+                  double seconds)    {
+    printf("%-6s %9s %9s  %9s %9s  %9s %9s  %9s  %6s  %s\n", "board", "cycles/s", "xfers/s", "xfer us", "max",
+           "cycle us", "max", "skipped/s", "errors", "P1 P2");
+    for(unsigned device = 0; device < manager.devices(); device++)    {
+        const piuio::DeviceStats &s = manager.stats(device);
+        const piuio::DeviceStats &l = last[device];
+        uint64_t cycles = s.cycles - l.cycles, transfers = s.transfers - l.transfers;
+        piuio::InputState state;
+        bool valid = manager.input(device, state);
+        uint64_t suppressed = manager.lampFilter(device).suppressed();
+        printf("%-6u %9.1f %9.1f  %9.1f %9.1f  %9.1f %9.1f  %9.1f  %6llu  ", device, cycles / seconds,
+               transfers / seconds, transfers ? (s.transferNs - l.transferNs) / 1e3 / transfers : 0,
+               s.transferMaxNs / 1e3, cycles ? (s.cycleNs - l.cycleNs) / 1e3 / cycles : 0, s.cycleMaxNs / 1e3,
+               (suppressed - skipped[device]) / seconds, (unsigned long long)s.errors);
+        if(!manager.present(device))
+            printf("gone\n");
+        else if(valid)
+            printf("%02X %02X\n", state.merged(0), state.merged(1));
+        else
+            printf("-\n");
+        last[device] = s;
+        skipped[device] = suppressed;
+    }
+}
+
+int main(int argc, char **argv)    {
+    unsigned sim = 0, transferUs = 1000, windowUs = 0;
+    bool combined = true, merged = false;
+    double seconds = 5;
+    for(int i = 1; i < argc; i++)    {
+        if(!strcmp(argv[i], "--sim") && i + 1 < argc)
+            sim = atoi(argv[++i]);
+        else if(!strcmp(argv[i], "-t") && i + 1 < argc)
+            transferUs = atoi(argv[++i]);
+        else if(!strcmp(argv[i], "--legacy"))
+            combined = false;
+        else if(!strcmp(argv[i], "-w") && i + 1 < argc)
+            windowUs = atoi(argv[++i]);
+        else if(!strcmp(argv[i], "--merged"))
+            merged = true;
+        else
+            seconds = atof(argv[i]);
+    }
+
+    piuio::SimBus simBus(sim, transferUs);
+    piuio::UsbBus usbBus;
+    for(unsigned device = 0; device < sim; device++)
+        simBus.board(device).setMerged(merged);
+    piuio::Manager manager(sim ? (piuio::Bus &)simBus : usbBus, combined);
+    manager.setLampFilter(windowUs, merged);
+    int r = manager.open();
+    if(r < 0)    {
+        fprintf(stderr, "Can't open the boards (%04x:%04x): %s\n", piuio::VID, piuio::PID, piuio::errorName(r));
+        return 1;
+    }
+    printf("%d board%s, %s\n", r, r == 1 ? "" : "s", sim ? "simulated" : "on USB");
+
+    std::vector<piuio::DeviceStats> last(manager.devices());
+    std::vector<uint64_t> skipped(manager.devices());
+    int64_t start = piuio::Poller::now(), lastPrint = start;
+    while(piuio::Poller::now() - start < (int64_t)(seconds * 1e9))    {
+        int64_t now = piuio::Poller::now();
+        for(unsigned device = 0; device < sim; device++)    {       //    Each one stepping at its own pace
+            unsigned step = now / 1000000 / (50 + 10 * device);
+            for(unsigned sensor = 0; sensor < piuio::MUX_POSITIONS; sensor++)
+                simBus.board(device).setPanels(0, sensor, sensor == step % 4 ? 1 << (step / 4 % 5) : 0);
+        }
+        if(manager.run(100) < 0)
+            break;
+        for(unsigned device = 0; device < manager.devices(); device++)    {
+            piuio::InputState state;
+            piuio::LampFrame lamps;
+            if(!manager.input(device, state))
+                continue;
+            for(unsigned player = 0; player < piuio::PLAYERS; player++)
+                lamps.setPanels(player, state.merged(player));
+            manager.setLamps(device, lamps);
+        }
+        now = piuio::Poller::now();
+        if(now - lastPrint >= 1000000000)    {
+            print(manager, last, skipped, (now - lastPrint) / 1e9);
+            lastPrint = now;
+        }
+    }
+    manager.close();
+    return 0;
+}
@@ -0,0 +1,87 @@
+/***********************************************************/
+/*    Pad monitor on top of the host library               */
+/***********************************************************/
+/*    Polls a board with piuio::Client and shows every     */
+/*    sensor of both pads, lighting the panels that are    */
+/*    down. With --mock it runs on a MockTransport with    */
+/*    steps stepping around by themselves, no board needed.*/
+/*                                                         */
+/*    Build from the repository root:                      */
+/*      g++ -O2 -std=c++11 -Ihost/lib \                    */
+/*          host/lib/piuio.cpp host/lib/piuio_usb.cpp \    */
+/*          host/lib/piuio_mock.cpp \                      */
+/*          host/tools/piuio_monitor.cpp \                 */
+/*          -o piuio_monitor -lusb-1.0                     */
+/*    Run: ./piuio_monitor [--mock] [--legacy] [seconds]   */
+/***********************************************************/
+#include <piuio.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+
+//    Panels of one player per sensor, like "UL UR C DL DR"
+static void printPanels(const piuio::InputState &state, unsigned player)    {
+    static const char names[] = "LRCld";
+    for(unsigned sensor = 0; sensor < piuio::MUX_POSITIONS; sensor++)    {
+        for(unsigned panel = 0; panel < 5; panel++)
+            putchar(state.panels[player][sensor] & (1 << panel) ? names[panel] : '.');
+        putchar(' ');
+    }
+}
+
+int main(int argc, char **argv)    {
+    bool mock = false, combined = true;
+    double seconds = 10;
+    for(int i = 1; i < argc; i++)    {
+        if(!strcmp(argv[i], "--mock"))
+            mock = true;
+        else if(!strcmp(argv[i], "--legacy"))
+            combined = false;
+        else
+            seconds = atof(argv[i]);
+    }
+
+    piuio::MockTransport board;
+    piuio::UsbTransport usb;
+    if(!mock)    {
+        int r = usb.open();
+        if(r < 0)    {
+            fprintf(stderr, "Can't open a PIUIO (%04x:%04x): %s\n", piuio::VID, piuio::PID, piuio::errorName(r));
+            return 1;
+        }
+    }
+    piuio::Client client(mock ? (piuio::Transport &)board : usb, combined);
+
+    piuio::InputState state;
+    unsigned long polls = 0;
+    typedef std::chrono::steady_clock Clock;
+    Clock::time_point start = Clock::now();
+    double elapsed = 0;
+    int r = 0;
+    while(elapsed < seconds)    {
+        if(mock)    {                                           //    A step walking around both pads
+            board.setPanels(polls / 64 % 2, polls / 16 % 4, 1 << (polls / 128 % 5));
+            board.setPanels(!(polls / 64 % 2), polls / 16 % 4, 0);
+        }
+        client.lamps().setPanels(0, state.merged(0));           //    Light what is pressed
+        client.lamps().setPanels(1, state.merged(1));
+        r = client.poll(state);
+        if(r < 0)    {
+            fprintf(stderr, "\nPoll failed: %s\n", piuio::errorName(r));
+            break;
+        }
+        polls++;
+        elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+        printf("\rP1 ");
+        printPanels(state, 0);
+        printf(" P2 ");
+        printPanels(state, 1);
+        printf(" buttons %02X %02X  %s %7.1f polls/s", state.buttons[0], state.buttons[1],
+               client.combined() ? "0xB1" : "0xAE", polls / elapsed);
+        fflush(stdout);
+    }
+    printf("\n");
+    return r < 0;
+}
@@ -0,0 +1,131 @@
+/***********************************************************/
+/*    Input service: one owner, many readers               */
+/***********************************************************/
+/*    Owns the board, runs the muxer cycle and publishes   */
+/*    every cycle in shared memory (piuio_shm.h). Any      */
+/*    number of processes can then follow the inputs with  */
+/*    SharedReader without touching the USB device.        */
+/*    --watch is such a reader: it prints the edges as     */
+/*    they come and the state every 100ms.                 */
+/*                                                         */
+/*    Build from the repository root:                      */
+/*      g++ -O2 -std=c++11 -Ihost/lib \                    */
+/*          host/lib/piuio.cpp host/lib/piuio_usb.cpp \    */
+/*          host/lib/piuio_mock.cpp \                      */
+/*          host/lib/piuio_poller.cpp \                    */
+/*          host/lib/piuio_shm.cpp \                       */
+/*          host/tools/piuio_service.cpp \                 */
+/*          -o piuio_service -lusb-1.0 -lpthread -lrt      */
+/*    Run: ./piuio_service [--mock] [--legacy] [-p us]     */
+/*         ./piuio_service --watch                         */
+/***********************************************************/
+#include <piuio_shm.h>
+#include <piuio_poller.h>
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static volatile sig_atomic_t Quit = 0;
+
+static void onSignal(int)    {
+    Quit = 1;
+}
+
+static void sleepUs(unsigned us)    {
+    struct timespec ts = { (time_t)(us / 1000000), (long)(us % 1000000) * 1000 };
+    nanosleep(&ts, 0);
+}
+
+static int watch()    {
+    piuio::SharedReader reader;
+    int r = reader.open();
+    if(r < 0)    {
+        fprintf(stderr, "No input service running: %s\n", piuio::errorName(r));
+        return 1;
+    }
+    uint64_t lost = 0;
+    int64_t lastPrint = 0;
+    while(!Quit)    {
+        piuio::Edge edges[64];
+        unsigned n = reader.edges(edges, 64, &lost);
+        for(unsigned i = 0; i < n; i++)
+            if(edges[i].sensor == piuio::SENSOR_BUTTONS)
+                printf("%12.3f ms  P%u buttons   %02X -> %02X\n", edges[i].ns / 1e6, edges[i].player + 1,
+                       edges[i].changed, edges[i].state);
+            else
+                printf("%12.3f ms  P%u sensor %u  %02X -> %02X\n", edges[i].ns / 1e6, edges[i].player + 1,
+                       edges[i].sensor, edges[i].changed, edges[i].state);
+        int64_t now = piuio::Poller::now();
+        if(now - lastPrint > 100000000)    {
+            piuio::Snapshot s;
+            if(reader.read(s) < 0)    {
+                fprintf(stderr, "The input service stopped\n");
+                return 1;
+            }
+            printf("cycle %llu  P1 %02X  P2 %02X  buttons %02X %02X  age %.3f ms  %s  lost %llu\n",
+                   (unsigned long long)s.cycle, s.state.merged(0), s.state.merged(1), s.state.buttons[0],
+                   s.state.buttons[1], (now - s.startNs) / 1e6, piuio::errorName(s.error), (unsigned long long)lost);
+            lastPrint = now;
+        }
+        if(!n)
+            sleepUs(1000);
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)    {
+    bool mock = false, combined = true;
+    unsigned periodUs = 1000;
+    for(int i = 1; i < argc; i++)    {
+        if(!strcmp(argv[i], "--watch"))
+            return signal(SIGINT, onSignal), watch();
+        else if(!strcmp(argv[i], "--mock"))
+            mock = true;
+        else if(!strcmp(argv[i], "--legacy"))
+            combined = false;
+        else if(!strcmp(argv[i], "-p") && i + 1 < argc)
+            periodUs = atoi(argv[++i]);
+    }
+    signal(SIGINT, onSignal);
+    signal(SIGTERM, onSignal);
+
+    piuio::MockTransport board;
+    piuio::UsbTransport usb;
+    if(!mock)    {
+        int r = usb.open();
+        if(r < 0)    {
+            fprintf(stderr, "Can't open a PIUIO (%04x:%04x): %s\n", piuio::VID, piuio::PID, piuio::errorName(r));
+            return 1;
+        }
+    }
+    piuio::Client client(mock ? (piuio::Transport &)board : usb, combined);
+    piuio::SharedWriter writer;
+    int r = writer.create();
+    if(r < 0)    {
+        fprintf(stderr, "Can't create %s: %s\n", PIUIO_SHM_NAME, piuio::errorName(r));
+        return 1;
+    }
+
+    piuio::InputState state;
+    unsigned long cycles = 0;
+    while(!Quit)    {
+        if(mock)    {                                           //    Someone stepping around
+            board.setPanels(0, cycles / 64 % 4, 1 << (cycles / 256 % 5));
+            board.setPanels(0, (cycles / 64 + 3) % 4, 0);
+        }
+        int64_t start = piuio::Poller::now();
+        r = client.poll(state);
+        writer.publish(state, start, piuio::Poller::now(), r);
+        if(r == piuio::ERROR_NO_DEVICE)    {
+            fprintf(stderr, "The board is gone\n");
+            break;
+        }
+        cycles++;
+        if(periodUs)
+            sleepUs(periodUs);
+    }
+    return r < 0;
+}
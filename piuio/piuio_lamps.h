@@ -0,0 +1,87 @@
+/***********************************************************/
+/*   ____ ___ _   _ ___ ___     ____ _                     */
+/*  |  _ \_ _| | | |_ _/ _ \   / ___| | ___  _ __   ___    */
+/*  | |_) | || | | || | | | | | |   | |/ _ \| '_ \ / _ \   */
+/*  |  __/| || |_| || | |_| | | |___| | (_) | | | |  __/   */
+/*  |_|  |___|\___/|___\___/   \____|_|\___/|_| |_|\___|   */
+/*                                                         */
+/***********************************************************/
+/*    Lamp mapping from the OpenITG lamp bytes (Output[]   */
+/*    in the sketches, see docs/piuio.txt) to the bytes    */
+/*    each board writes to its latches or ports.           */
+/*    Every board profile is written once here as a list   */
+/*    of fields, which the templates turn into masks and   */
+/*    shifts. host/bench/lamp_bench checks they give the   */
+/*    bytes the hand written code gave, bit for bit. The   */
+/*    AVR code of the two has not been compared.           */
+/***********************************************************/
+/*                    License is GPLv3                     */
+/*  Please consult https://github.com/racerxdl/piuio_clone */
+/***********************************************************/
+#ifndef PIUIO_LAMPS_H
+#define PIUIO_LAMPS_H
+
+//    Bits Mask of Output[Byte], moved by Shift (negative is to the right).
+//    A field is a run of protocol bits that lands on a run of output bits.
+template<unsigned char Byte, unsigned char Mask, signed char Shift>
+struct LampField    {
+    static inline unsigned char get(const unsigned char *out)    {
+        //    One of the two shifts is always 0
+        return (unsigned char)(((out[Byte] & Mask) << (Shift > 0 ? Shift : 0)) >> (Shift < 0 ? -Shift : 0));
+    }
+};
+
+//    Placeholder for unused fields, adds nothing
+struct LampNone    {
+    static inline unsigned char get(const unsigned char *)    { return 0; }
+};
+
+//    One output byte: the OR of up to 6 fields
+template<class A, class B = LampNone, class C = LampNone,
+         class D = LampNone, class E = LampNone, class F = LampNone>
+struct LampByte    {
+    static inline unsigned char get(const unsigned char *out)    {
+        return A::get(out) | B::get(out) | C::get(out) | D::get(out) | E::get(out) | F::get(out);
+    }
+};
+
+//    Halo and cabinet latch, the same on every board:
+//    bit 0-2 halo R2/L1/L2 from Output[3], bit 3 halo R1 from Output[2],
+//    bit 4 neon and bit 5-6 cabinet buttons from Output[1]
+typedef LampByte<
+    LampField<3, 0b00000111, 0>,
+    LampField<2, 0b10000000, -4>,
+    LampField<1, 0b00000100, 2>,
+    LampField<1, 0b00011000, 2>
+> HaloLamps;
+
+//    Uno clone: P1 pad lamps on the high nibble, P2 on the low one
+struct CloneLamps    {
+    typedef HaloLamps Halo;
+    typedef LampByte<
+        LampField<0, 0b00111100, 2>,
+        LampField<2, 0b00111100, -2>
+    > Pads;
+};
+
+//    Mega: the same bytes, pads on PORTL and halo on PORTC, no latches
+struct MegaLamps    {
+    typedef HaloLamps Halo;
+    typedef CloneLamps::Pads Pads;
+};
+
+//    Lights only: P1 pad lamps on the low nibble, P2 on the high one,
+//    and the ZZ muxer bits of both players on PORTC0-3
+struct LightsOnlyLamps    {
+    typedef HaloLamps Halo;
+    typedef LampByte<
+        LampField<0, 0b00111100, -2>,
+        LampField<2, 0b00111100, 2>
+    > Pads;
+    typedef LampByte<
+        LampField<0, 0b00000011, 0>,
+        LampField<2, 0b00000011, 2>
+    > Muxers;
+};
+
+#endif
@@ -0,0 +1,29 @@
+/***********************************************************/
+/*   ____ ___ _   _ ___ ___     ____ _                     */
+/*  |  _ \_ _| | | |_ _/ _ \   / ___| | ___  _ __   ___    */
+/*  | |_) | || | | || | | | | | |   | |/ _ \| '_ \ / _ \   */
+/*  |  __/| || |_| || | |_| | | |___| | (_) | | | |  __/   */
+/*  |_|  |___|\___/|___\___/   \____|_|\___/|_| |_|\___|   */
+/*                                                         */
+/***********************************************************/
+/*    Markers the sketches write to GPIOR0 with            */
+/*    BENCH_MARKS, so an AVR simulator (simavr) can count  */
+/*    the cycles between them. A marker is the ID when a   */
+/*    piece of code starts and ID | MARK_EXIT when it      */
+/*    ends. GPIOR0 is free on both the 328P and the 2560,  */
+/*    and writing it is a single OUT instruction.          */
+/***********************************************************/
+/*                    License is GPLv3                     */
+/*  Please consult https://github.com/racerxdl/piuio_clone */
+/***********************************************************/
+#ifndef PIUIO_MARKS_H
+#define PIUIO_MARKS_H
+
+#define MARK_LOOP       1               //    loop(), also gives the time between loops
+#define MARK_USBPOLL    2               //    usbPoll(), with the request handlers it calls
+#define MARK_SCAN       3               //    pollInputOutput()
+#define MARK_LAMPS      4               //    updateLamps() for a new lamp frame
+#define MARK_COUNT      5
+#define MARK_EXIT       0x80
+
+#endif